@@ -0,0 +1,463 @@
+/*
+ * ARP module for netcfg.
+ *
+ * Licensed under the terms of the GNU General Public License
+ */
+
+#include "netcfg.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <debian-installer.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <netpacket/packet.h>
+
+/* Requests go out after 0, 10, 30, 70, ... ms, doubling up to this gap. */
+#define ARP_FIRST_INTERVAL 10
+#define ARP_MAX_INTERVAL 500
+
+/* RFC 5227 probes and announcements, fewer and closer together than the
+ * RFC's seconds so that they fit in an install: the probes are spread
+ * over the caller's budget, the announcements this many ms apart. */
+#define ARP_PROBE_NUM 3
+#define ARP_ANNOUNCE_NUM 2
+#define ARP_ANNOUNCE_INTERVAL 100
+
+/* A sweep asks for each address twice, in two passes each starting half
+ * way through the caller's time, and sends no faster than one request
+ * per this many microseconds: a quarter second per pass for a /24. */
+#define ARP_SWEEP_PASSES 2
+#define ARP_SWEEP_GAP_US 1000
+
+struct arp_socket {
+    int fd;
+    int ifindex;
+    unsigned char hwaddr[ETH_ALEN];
+    struct in_addr addr;         /* our address on the link, may be 0 */
+    struct timespec last_sent;
+};
+
+static long elapsed_us(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000L +
+        (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/* Open a packet socket for ARP on iface.  Returns 0 on success. */
+static int arp_socket_open(struct arp_socket *as, const char *iface)
+{
+    struct sockaddr_ll sll;
+    struct ifreq ifr;
+
+    memset(as, 0, sizeof(*as));
+
+    as->fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, htons(ETH_P_ARP));
+    if (as->fd < 0) {
+        di_warning("arp: could not open packet socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
+
+    if (ioctl(as->fd, SIOCGIFINDEX, &ifr) < 0)
+        goto fail;
+    as->ifindex = ifr.ifr_ifindex;
+
+    if (ioctl(as->fd, SIOCGIFHWADDR, &ifr) < 0)
+        goto fail;
+    if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+        goto fail; /* nothing to ARP for on this link */
+    memcpy(as->hwaddr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    ifr.ifr_addr.sa_family = AF_INET;
+    if (ioctl(as->fd, SIOCGIFADDR, &ifr) == 0)
+        as->addr = ((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ARP);
+    sll.sll_ifindex = as->ifindex;
+
+    if (bind(as->fd, (struct sockaddr *) &sll, sizeof(sll)) < 0)
+        goto fail;
+
+    return 0;
+
+ fail:
+    di_warning("arp: cannot use %s: %s", iface, strerror(errno));
+    close(as->fd);
+    as->fd = -1;
+    return -1;
+}
+
+static void arp_socket_close(struct arp_socket *as)
+{
+    if (as->fd >= 0)
+        close(as->fd);
+    as->fd = -1;
+}
+
+/* Broadcast an ARP request for target, from sender (0 for a probe). */
+static int arp_send_request(struct arp_socket *as, struct in_addr sender,
+                            struct in_addr target)
+{
+    struct ether_arp req;
+    struct sockaddr_ll sll;
+
+    memset(&req, 0, sizeof(req));
+    req.arp_hrd = htons(ARPHRD_ETHER);
+    req.arp_pro = htons(ETH_P_IP);
+    req.arp_hln = ETH_ALEN;
+    req.arp_pln = 4;
+    req.arp_op = htons(ARPOP_REQUEST);
+    memcpy(req.arp_sha, as->hwaddr, ETH_ALEN);
+    memcpy(req.arp_spa, &sender, 4);
+    memcpy(req.arp_tpa, &target, 4);
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ARP);
+    sll.sll_ifindex = as->ifindex;
+    sll.sll_halen = ETH_ALEN;
+    memset(sll.sll_addr, 0xff, ETH_ALEN);
+
+    clock_gettime(CLOCK_MONOTONIC, &as->last_sent);
+
+    if (sendto(as->fd, &req, sizeof(req), 0,
+               (struct sockaddr *) &sll, sizeof(sll)) < 0) {
+        di_warning("arp: send failed: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Read one ARP packet.  Returns 1 if one was read, 0 if there was none. */
+static int arp_recv(struct arp_socket *as, struct ether_arp *pkt)
+{
+    ssize_t len = recv(as->fd, pkt, sizeof(*pkt), MSG_DONTWAIT);
+
+    if (len < (ssize_t) sizeof(*pkt))
+        return 0;
+
+    if (ntohs(pkt->arp_hrd) != ARPHRD_ETHER ||
+        ntohs(pkt->arp_pro) != ETH_P_IP ||
+        pkt->arp_hln != ETH_ALEN || pkt->arp_pln != 4)
+        return 0;
+
+    return 1;
+}
+
+/*
+ * ARP for target on every interface in ifaces at once, until one of them
+ * gets a reply or timeout_ms runs out.  Requests start 10ms apart and back
+ * off to half a second.  Returns the index of the interface that got the
+ * first reply and sets *rtt_us to the time since the last request on it,
+ * -1 if nothing answered, or -2 if no interface could be used at all.
+ */
+int arp_ping(char **ifaces, int num_ifaces, struct in_addr target,
+             int timeout_ms, long *rtt_us)
+{
+    struct arp_socket *socks;
+    struct pollfd *pfds;
+    struct timespec start;
+    int interval = ARP_FIRST_INTERVAL, next_send = 0;
+    int i, usable = 0, ret = -1;
+
+    socks = calloc(num_ifaces, sizeof(*socks));
+    pfds = calloc(num_ifaces, sizeof(*pfds));
+    if (!socks || !pfds) {
+        free(socks);
+        free(pfds);
+        return -2;
+    }
+
+    for (i = 0; i < num_ifaces; i++) {
+        if (arp_socket_open(&socks[i], ifaces[i]) == 0)
+            usable++;
+        pfds[i].fd = socks[i].fd; /* poll() ignores negative fds */
+        pfds[i].events = POLLIN;
+    }
+
+    if (!usable) {
+        ret = -2;
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (ret < 0) {
+        long now_ms = elapsed_us(&start) / 1000;
+        int wait_ms;
+
+        if (now_ms >= timeout_ms)
+            break;
+
+        if (now_ms >= next_send) {
+            for (i = 0; i < num_ifaces; i++)
+                if (socks[i].fd >= 0)
+                    arp_send_request(&socks[i], socks[i].addr, target);
+            next_send = now_ms + interval;
+            if ((interval *= 2) > ARP_MAX_INTERVAL)
+                interval = ARP_MAX_INTERVAL;
+        }
+
+        wait_ms = next_send - now_ms;
+        if (wait_ms > timeout_ms - now_ms)
+            wait_ms = timeout_ms - now_ms;
+
+        if (poll(pfds, num_ifaces, wait_ms) <= 0)
+            continue;
+
+        for (i = 0; i < num_ifaces && ret < 0; i++) {
+            struct ether_arp pkt;
+
+            if (!(pfds[i].revents & POLLIN))
+                continue;
+
+            while (arp_recv(&socks[i], &pkt)) {
+                if (ntohs(pkt.arp_op) == ARPOP_REPLY &&
+                    memcmp(pkt.arp_spa, &target, 4) == 0) {
+                    if (rtt_us)
+                        *rtt_us = elapsed_us(&socks[i].last_sent);
+                    ret = i;
+                    break;
+                }
+            }
+        }
+    }
+
+ out:
+    for (i = 0; i < num_ifaces; i++)
+        arp_socket_close(&socks[i]);
+    free(socks);
+    free(pfds);
+
+    return ret;
+}
+
+/*
+ * Before taking addr on iface, probe for it (RFC 5227 2.1): ARP requests
+ * from 0.0.0.0, spread over budget_ms, listening all the while.  Any ARP
+ * from another host with addr as its sender, or probing for addr itself,
+ * is a conflict.  Returns 1 on a conflict with the other host's hardware
+ * address in owner, 0 if nobody claimed addr, or -1 if iface can't be
+ * probed (not Ethernet, no packet sockets).
+ */
+int arp_probe(const char *iface, struct in_addr addr, int budget_ms,
+              unsigned char *owner)
+{
+    struct in_addr none = { 0 };
+    struct arp_socket as;
+    struct pollfd pfd;
+    struct timespec start;
+    int sent = 0, ret = 0;
+
+    if (arp_socket_open(&as, iface) < 0)
+        return -1;
+
+    pfd.fd = as.fd;
+    pfd.events = POLLIN;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (ret == 0) {
+        long now_ms = elapsed_us(&start) / 1000;
+        long next_ms = sent < ARP_PROBE_NUM ?
+            (long) budget_ms * sent / ARP_PROBE_NUM : budget_ms;
+        struct ether_arp pkt;
+
+        if (now_ms >= budget_ms)
+            break;
+
+        if (sent < ARP_PROBE_NUM && now_ms >= next_ms) {
+            arp_send_request(&as, none, addr);
+            sent++;
+            continue;
+        }
+
+        if (poll(&pfd, 1, next_ms - now_ms) <= 0)
+            continue;
+
+        while (arp_recv(&as, &pkt)) {
+            if (memcmp(pkt.arp_sha, as.hwaddr, ETH_ALEN) == 0)
+                continue; /* our own */
+
+            if (memcmp(pkt.arp_spa, &addr, 4) == 0 ||
+                (ntohs(pkt.arp_op) == ARPOP_REQUEST &&
+                 memcmp(pkt.arp_spa, &none, 4) == 0 &&
+                 memcmp(pkt.arp_tpa, &addr, 4) == 0)) {
+                memcpy(owner, pkt.arp_sha, ETH_ALEN);
+                ret = 1;
+                break;
+            }
+        }
+    }
+
+    arp_socket_close(&as);
+    return ret;
+}
+
+/*
+ * Announce that addr is now ours on iface (RFC 5227 2.3), so that
+ * neighbours and switches update their caches rather than waiting for
+ * the old entries to time out.  Returns 0 if the announcements went out.
+ */
+int arp_announce(const char *iface, struct in_addr addr)
+{
+    struct arp_socket as;
+    int i, ret = 0;
+
+    if (arp_socket_open(&as, iface) < 0)
+        return -1;
+
+    for (i = 0; i < ARP_ANNOUNCE_NUM; i++) {
+        if (i)
+            poll(NULL, 0, ARP_ANNOUNCE_INTERVAL);
+        if (arp_send_request(&as, addr, addr) < 0)
+            ret = -1;
+    }
+
+    arp_socket_close(&as);
+    return ret;
+}
+
+/*
+ * Find out which of the count addresses from first up are in use on iface,
+ * within timeout_ms: probe each one that hasn't been heard from yet, in
+ * ARP_SWEEP_PASSES rate-limited passes, and note every address that
+ * answers or otherwise shows up as an ARP sender.  taken[i] is set for
+ * first + i if it is in use.  Returns the number in use, or -1 if iface
+ * can't be swept.
+ */
+int arp_sweep(const char *iface, struct in_addr first, int count,
+              int timeout_ms, unsigned char *taken)
+{
+    struct in_addr none = { 0 };
+    struct arp_socket as;
+    struct pollfd pfd;
+    struct timespec start;
+    uint32_t base = ntohl(first.s_addr);
+    long next_us = 0;
+    int pass = 0, next = 0, used = 0;
+
+    if (arp_socket_open(&as, iface) < 0)
+        return -1;
+
+    memset(taken, 0, count);
+    pfd.fd = as.fd;
+    pfd.events = POLLIN;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        long now_us = elapsed_us(&start);
+        long wait_us = timeout_ms * 1000L - now_us;
+        struct ether_arp pkt;
+
+        if (wait_us <= 0)
+            break;
+
+        if (pass < ARP_SWEEP_PASSES) {
+            while (next < count && taken[next])
+                next++;
+
+            if (next == count) {
+                pass++;
+                next = 0;
+                if (next_us < timeout_ms * 1000L * pass / ARP_SWEEP_PASSES)
+                    next_us = timeout_ms * 1000L * pass / ARP_SWEEP_PASSES;
+                continue;
+            }
+
+            if (now_us >= next_us) {
+                struct in_addr target;
+
+                target.s_addr = htonl(base + next++);
+                arp_send_request(&as, none, target);
+                next_us = now_us + ARP_SWEEP_GAP_US;
+                continue;
+            }
+
+            if (wait_us > next_us - now_us)
+                wait_us = next_us - now_us;
+        }
+
+        if (poll(&pfd, 1, (wait_us + 999) / 1000) <= 0)
+            continue;
+
+        while (arp_recv(&as, &pkt)) {
+            uint32_t sender;
+
+            if (memcmp(pkt.arp_sha, as.hwaddr, ETH_ALEN) == 0)
+                continue; /* our own */
+
+            memcpy(&sender, pkt.arp_spa, 4);
+            sender = ntohl(sender) - base;
+            if (sender < (uint32_t) count && !taken[sender]) {
+                taken[sender] = 1;
+                used++;
+            }
+        }
+    }
+
+    arp_socket_close(&as);
+    return used;
+}
+
+#else /* !__linux__ */
+
+/* No packet sockets here; callers fall back to the arping command. */
+int arp_ping(char **ifaces, int num_ifaces, struct in_addr target,
+             int timeout_ms, long *rtt_us)
+{
+    (void) ifaces;
+    (void) num_ifaces;
+    (void) target;
+    (void) timeout_ms;
+    (void) rtt_us;
+    return -2;
+}
+
+int arp_probe(const char *iface, struct in_addr addr, int budget_ms,
+              unsigned char *owner)
+{
+    (void) iface;
+    (void) addr;
+    (void) budget_ms;
+    (void) owner;
+    return -1;
+}
+
+int arp_announce(const char *iface, struct in_addr addr)
+{
+    (void) iface;
+    (void) addr;
+    return -1;
+}
+
+int arp_sweep(const char *iface, struct in_addr first, int count,
+              int timeout_ms, unsigned char *taken)
+{
+    (void) iface;
+    (void) first;
+    (void) count;
+    (void) timeout_ms;
+    (void) taken;
+    return -1;
+}
+
+#endif /* __linux__ */
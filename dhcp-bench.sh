@@ -0,0 +1,111 @@
+#!/bin/sh
+# Boot storm benchmark for netcfg's built-in DHCP client.
+#
+# Creates one network namespace per host, each with a veth into a bridge
+# in a server namespace running dnsmasq, then starts ./dhcp-bench in all
+# of them at once and reports time to lease, retransmissions and what the
+# server dropped.
+#
+# Usage: dhcp-bench.sh [-n hosts] [-t timeout] [-d delay] [-r] [-N]
+#   -n  number of hosts (default 100)
+#   -t  per-host timeout in seconds (default 25)
+#   -d  spread the hosts' starts over up to delay ms, by MAC
+#   -r  let dnsmasq answer with rapid commit
+#   -N  don't ask for rapid commit in the client
+#
+# Needs root, iproute2, dnsmasq, and dhcp-bench built with "make dhcp-bench".
+
+set -e
+
+HOSTS=100
+TIMEOUT=25
+SERVER_OPTS=
+CLIENT_OPTS=
+
+while getopts n:t:d:rN opt; do
+	case $opt in
+	n) HOSTS=$OPTARG ;;
+	t) TIMEOUT=$OPTARG ;;
+	r) SERVER_OPTS=--dhcp-rapid-commit ;;
+	d) CLIENT_OPTS="$CLIENT_OPTS -d $OPTARG" ;;
+	N) CLIENT_OPTS="$CLIENT_OPTS -n" ;;
+	*) sed -n 's/^# \{0,1\}//; 9,16p' "$0" >&2; exit 1 ;;
+	esac
+done
+
+BENCH=$(cd "$(dirname "$0")" && pwd)/dhcp-bench
+if [ ! -x "$BENCH" ]; then
+	echo "dhcp-bench.sh: build dhcp-bench first (make dhcp-bench)" >&2
+	exit 1
+fi
+
+NS=dhcpb$$
+SRV=${NS}s
+DIR=$(mktemp -d)
+
+cleanup () {
+	[ -f "$DIR/dnsmasq.pid" ] && kill "$(cat "$DIR/dnsmasq.pid")" 2>/dev/null
+	for i in $(seq 1 "$HOSTS"); do
+		ip netns del "$NS$i" 2>/dev/null
+	done
+	ip netns del "$SRV" 2>/dev/null
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+ip netns add "$SRV"
+ip -n "$SRV" link set lo up
+ip -n "$SRV" link add br0 type bridge
+ip -n "$SRV" addr add 10.99.0.1/16 dev br0
+ip -n "$SRV" link set br0 up
+
+for i in $(seq 1 "$HOSTS"); do
+	ip netns add "$NS$i"
+	ip link add eth0 netns "$NS$i" type veth peer name h$i netns "$SRV"
+	ip -n "$SRV" link set h$i master br0 up
+	ip -n "$NS$i" link set lo up
+	ip -n "$NS$i" link set eth0 up
+done
+
+# Let the bridge ports settle before anything is timed
+sleep 1
+
+ip netns exec "$SRV" dnsmasq --conf-file=/dev/null --user=root --port=0 \
+	--interface=br0 --bind-interfaces \
+	--dhcp-range=10.99.1.0,10.99.255.254,1h --dhcp-lease-max=65535 \
+	--dhcp-leasefile="$DIR/leases" --pid-file="$DIR/dnsmasq.pid" \
+	--log-dhcp --log-facility="$DIR/dnsmasq.log" $SERVER_OPTS
+sleep 1
+
+for i in $(seq 1 "$HOSTS"); do
+	ip netns exec "$NS$i" "$BENCH" $CLIENT_OPTS eth0 "$TIMEOUT" \
+		> "$DIR/host$i" 2>/dev/null &
+done
+wait || true
+
+# Receive buffer overflows on the server's DHCP socket (port 67, 0x0043)
+DROPS=$(ip netns exec "$SRV" awk '$2 ~ /:0043$/ { d += $NF } END { print d + 0 }' \
+	/proc/net/udp)
+DISCOVERS=$(grep -c 'DHCPDISCOVER' "$DIR/dnsmasq.log" || true)
+OFFERS=$(grep -c 'DHCPOFFER' "$DIR/dnsmasq.log" || true)
+
+cat "$DIR"/host* | sort -k3 -n | awk -v hosts="$HOSTS" -v drops="$DROPS" \
+	-v discovers="$DISCOVERS" -v offers="$OFFERS" '
+	$2 == "ok" { t[++ok] = $3 }
+	{
+		# A lease takes one DISCOVER and, without rapid commit, one REQUEST
+		retrans += ($4 > 1 ? $4 - 1 : 0) + ($5 > 1 ? $5 - 1 : 0)
+	}
+	function pct(p,  i) {
+		i = int(p * ok + 0.999)
+		return ok ? t[i < 1 ? 1 : i] : "-"
+	}
+	END {
+		printf "hosts %d, leased %d, failed %d\n", hosts, ok, hosts - ok
+		printf "time to lease (ms): p50 %s, p99 %s, max %s\n",
+		       pct(0.50), pct(0.99), ok ? t[ok] : "-"
+		printf "client retransmissions: %d\n", retrans
+		printf "server: %d DISCOVERs logged, %d OFFERs, %d socket drops\n",
+		       discovers, offers, drops
+	}'
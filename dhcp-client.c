@@ -0,0 +1,1652 @@
+/*
+ * Built-in DHCPv4 client for netcfg.
+ *
+ * Gets a lease over a packet socket, applies it over rtnetlink, and then
+ * keeps it renewed from a small daemon, so that no external client has to
+ * be found, configured and started for each attempt.
+ *
+ * Licensed under the terms of the GNU General Public License
+ */
+
+#include "netcfg.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/param.h>
+#include <debian-installer.h>
+
+/* Ask for a two-message exchange (RFC 4039) in DHCPDISCOVER */
+int dhcp_engine_rapid_commit = 1;
+
+/* Retransmissions start 1s apart, double up to 4s and are randomized by
+ * a quarter either way; no delay before the first message. */
+struct dhcp_backoff dhcp_backoff = { 1000, 4000, 25, 0 };
+
+/* FNV-1a */
+static uint32_t hwaddr_hash(const unsigned char *hwaddr, int len)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ hwaddr[i]) * 16777619u;
+    return hash;
+}
+
+/*
+ * How long, in ms, to hold off before the first message from the given
+ * hardware address: a hash of it, spread over dhcp_backoff.start_delay.
+ * Machines powered on together thus start apart, each always after the
+ * same delay.  Their clocks and pids are too much alike for random().
+ */
+int dhcp_start_delay(const unsigned char *hwaddr, int len)
+{
+    if (dhcp_backoff.start_delay <= 0)
+        return 0;
+    return hwaddr_hash(hwaddr, len) % (dhcp_backoff.start_delay + 1);
+}
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <netpacket/packet.h>
+#include <linux/filter.h>
+
+#define DHCP_SERVER_PORT 67
+#define DHCP_CLIENT_PORT 68
+#define DHCP_MAGIC 0x63825363
+
+/* How many REQUESTs to send for an offer before starting over. */
+#define DHCP_REQUEST_TRIES 4
+
+/* INIT-REBOOT: how often, and how far apart to start with, to ask for a
+ * cached address back before falling back to discovery.  A server that
+ * doesn't know us may well stay silent, so this is kept short. */
+#define DHCP_REBOOT_TRIES 2
+#define DHCP_REBOOT_INTERVAL 500
+
+/* RFC 2131 4.4.5: don't retransmit renewals more often than this. */
+#define DHCP_MIN_RENEW_INTERVAL 60
+
+/* Longest single wait while bound, so that timeouts fit in an int */
+#define DHCP_MAX_SLEEP 3600
+
+enum {
+    DHCPDISCOVER = 1, DHCPOFFER, DHCPREQUEST, DHCPDECLINE,
+    DHCPACK, DHCPNAK, DHCPRELEASE
+};
+
+enum {
+    OPT_PAD = 0,
+    OPT_SUBNET_MASK = 1,
+    OPT_ROUTER = 3,
+    OPT_DNS = 6,
+    OPT_HOSTNAME = 12,
+    OPT_DOMAIN = 15,
+    OPT_MTU = 26,
+    OPT_BROADCAST = 28,
+    OPT_NTP = 42,
+    OPT_REQUESTED_IP = 50,
+    OPT_LEASE_TIME = 51,
+    OPT_OVERLOAD = 52,
+    OPT_MSG_TYPE = 53,
+    OPT_SERVER_ID = 54,
+    OPT_PARAM_REQ = 55,
+    OPT_MAX_SIZE = 57,
+    OPT_T1 = 58,
+    OPT_T2 = 59,
+    OPT_VENDOR_CLASS = 60,
+    OPT_CLIENT_ID = 61,
+    OPT_RAPID_COMMIT = 80,
+    OPT_END = 255
+};
+
+/* What we ask for; the same set dhclient is configured to request. */
+static const uint8_t request_params[] = {
+    OPT_SUBNET_MASK, OPT_BROADCAST, 2 /* time offset */, OPT_ROUTER,
+    OPT_DOMAIN, OPT_DNS, OPT_HOSTNAME, OPT_NTP
+};
+
+struct dhcp_msg {
+    uint8_t op, htype, hlen, hops;
+    uint32_t xid;
+    uint16_t secs, flags;
+    uint32_t ciaddr, yiaddr, siaddr, giaddr;
+    uint8_t chaddr[16];
+    char sname[64];
+    char file[128];
+    uint32_t magic;
+    uint8_t options[312];
+} __attribute__ ((packed));
+
+struct dhcp_packet {
+    struct iphdr ip;
+    struct udphdr udp;
+    struct dhcp_msg msg;
+} __attribute__ ((packed));
+
+/* The fixed part of a message, up to and including the magic cookie */
+#define DHCP_FIXED_LEN (sizeof(struct dhcp_msg) - 312)
+
+#define DHCP_MAX_ADDRS 63 /* as many as fit in one option */
+
+struct dhcp_lease {
+    struct in_addr addr, netmask, broadcast, router, server;
+    struct in_addr nameservers[DHCP_MAX_ADDRS + 1];  /* 0-terminated */
+    struct in_addr ntp_servers[DHCP_MAX_ADDRS + 1];
+    char domain[256];
+    char hostname[MAXHOSTNAMELEN + 1];
+    uint32_t lease_time, t1, t2;     /* seconds */
+    int mtu;                         /* 0 if not given */
+    int rapid_commit;                /* the reply carried option 80 */
+    struct timespec start;           /* when the ACK arrived */
+};
+
+struct dhcp_engine {
+    char iface[IFNAMSIZ];
+    int ifindex;
+    uint8_t hwaddr[ETH_ALEN];
+    int raw_fd;                 /* packet socket, until bound */
+    int udp_fd;                 /* for renewals once bound */
+    uint32_t xid;
+    struct timespec start;      /* of this exchange, for the secs field */
+    const char *hostname;
+    struct dhcp_lease lease;
+    int sent[DHCPRELEASE + 1];  /* messages built, by type */
+};
+
+static const struct in_addr no_addr = { 0 };
+static const struct in_addr bcast_addr = { INADDR_BROADCAST };
+
+/* While racing, readable when the coordinator wants this engine to stop */
+static int engine_ctl_fd = -1;
+
+static volatile sig_atomic_t got_release, got_term;
+
+static long elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000L +
+        (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static uint16_t checksum(const void *data, size_t len, uint32_t sum)
+{
+    const uint8_t *p = data;
+
+    for (; len > 1; p += 2, len -= 2)
+        sum += (p[0] << 8) | p[1];
+    if (len)
+        sum += p[0] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return htons(~sum & 0xffff);
+}
+
+/*
+ * Only let DHCP replies through to the packet socket: unfragmented UDP to
+ * the client port.  Offsets are from the IP header on a SOCK_DGRAM socket.
+ */
+static int attach_filter(int fd)
+{
+    static struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 5),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 3, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, DHCP_CLIENT_PORT, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xffff),
+    };
+    struct sock_fprog prog = { ARRAY_SIZE(code), code };
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+/* Open the packet socket on e->iface.  Returns 0 on success. */
+static int raw_open(struct dhcp_engine *e)
+{
+    struct sockaddr_ll sll;
+    struct ifreq ifr;
+
+    /* No protocol until the filter is in place, so nothing slips past it */
+    e->raw_fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (e->raw_fd < 0) {
+        di_warning("dhcp: could not open packet socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, e->iface, IFNAMSIZ - 1);
+
+    if (ioctl(e->raw_fd, SIOCGIFINDEX, &ifr) < 0)
+        goto fail;
+    e->ifindex = ifr.ifr_ifindex;
+
+    if (ioctl(e->raw_fd, SIOCGIFHWADDR, &ifr) < 0)
+        goto fail;
+    if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+        errno = EAFNOSUPPORT;
+        goto fail;
+    }
+    memcpy(e->hwaddr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    /* Machines booted together have much the same pids and clocks;
+     * the hardware address keeps their xids and jitter apart. */
+    srandom(getpid() ^ time(NULL) ^ hwaddr_hash(e->hwaddr, ETH_ALEN));
+
+    if (attach_filter(e->raw_fd) < 0)
+        goto fail;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    sll.sll_ifindex = e->ifindex;
+
+    if (bind(e->raw_fd, (struct sockaddr *) &sll, sizeof(sll)) < 0)
+        goto fail;
+
+    return 0;
+
+ fail:
+    di_warning("dhcp: cannot use %s: %s", e->iface, strerror(errno));
+    close(e->raw_fd);
+    e->raw_fd = -1;
+    return -1;
+}
+
+/* Open a UDP socket on the client port, for talking to the server once
+ * the address is configured. */
+static int udp_open(struct dhcp_engine *e)
+{
+    struct sockaddr_in sin;
+    int one = 1;
+
+    e->udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (e->udp_fd < 0)
+        return -1;
+
+    setsockopt(e->udp_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(e->udp_fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+    if (setsockopt(e->udp_fd, SOL_SOCKET, SO_BINDTODEVICE,
+                   e->iface, strlen(e->iface) + 1) < 0)
+        goto fail;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(DHCP_CLIENT_PORT);
+
+    if (bind(e->udp_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+        goto fail;
+
+    return 0;
+
+ fail:
+    di_warning("dhcp: cannot open client port on %s: %s", e->iface, strerror(errno));
+    close(e->udp_fd);
+    e->udp_fd = -1;
+    return -1;
+}
+
+static void engine_close(struct dhcp_engine *e)
+{
+    if (e->raw_fd >= 0)
+        close(e->raw_fd);
+    if (e->udp_fd >= 0)
+        close(e->udp_fd);
+    e->raw_fd = e->udp_fd = -1;
+}
+
+static uint8_t *put_opt(uint8_t *p, int code, const void *data, size_t len)
+{
+    *p++ = code;
+    *p++ = len;
+    memcpy(p, data, len);
+    return p + len;
+}
+
+/* The client identifier we send: hardware type and address.  Returns its
+ * length; id must have room for ETH_ALEN + 1 bytes. */
+static size_t client_id(struct dhcp_engine *e, uint8_t *id)
+{
+    id[0] = ARPHRD_ETHER;
+    memcpy(id + 1, e->hwaddr, ETH_ALEN);
+    return ETH_ALEN + 1;
+}
+
+/*
+ * Fill in a message of the given type.  requested and server are added
+ * as options when non-zero; ciaddr is only set when renewing.  Returns
+ * the length of the message.
+ */
+static size_t build_msg(struct dhcp_engine *e, struct dhcp_msg *m, int type,
+                        struct in_addr ciaddr, struct in_addr requested,
+                        struct in_addr server)
+{
+    uint8_t *p = m->options;
+    uint8_t id[ETH_ALEN + 1];
+    long secs = elapsed_ms(&e->start) / 1000;
+    uint8_t t = type;
+
+    e->sent[type]++;
+
+    memset(m, 0, sizeof(*m));
+    m->op = 1; /* BOOTREQUEST */
+    m->htype = ARPHRD_ETHER;
+    m->hlen = ETH_ALEN;
+    m->xid = e->xid;
+    m->secs = htons(secs > 0xffff ? 0xffff : secs);
+    m->ciaddr = ciaddr.s_addr;
+    memcpy(m->chaddr, e->hwaddr, ETH_ALEN);
+    m->magic = htonl(DHCP_MAGIC);
+
+    p = put_opt(p, OPT_MSG_TYPE, &t, 1);
+    p = put_opt(p, OPT_CLIENT_ID, id, client_id(e, id));
+    if (requested.s_addr)
+        p = put_opt(p, OPT_REQUESTED_IP, &requested, 4);
+    if (server.s_addr)
+        p = put_opt(p, OPT_SERVER_ID, &server, 4);
+    if (type == DHCPDISCOVER && dhcp_engine_rapid_commit)
+        p = put_opt(p, OPT_RAPID_COMMIT, "", 0);
+
+    if (type != DHCPRELEASE) {
+        uint16_t max_size = htons(sizeof(struct dhcp_packet));
+
+        p = put_opt(p, OPT_MAX_SIZE, &max_size, 2);
+        p = put_opt(p, OPT_VENDOR_CLASS, "d-i", 3);
+        if (e->hostname && *e->hostname)
+            p = put_opt(p, OPT_HOSTNAME, e->hostname,
+                        MIN(strlen(e->hostname), MAXHOSTNAMELEN));
+        p = put_opt(p, OPT_PARAM_REQ, request_params, sizeof(request_params));
+    }
+    *p++ = OPT_END;
+
+    return p - (uint8_t *) m;
+}
+
+/* Send a message over the packet socket in a link-layer broadcast, from
+ * src (0.0.0.0 before we have an address) to dst. */
+static int send_raw(struct dhcp_engine *e, struct dhcp_msg *m, size_t len,
+                    struct in_addr src, struct in_addr dst)
+{
+    struct dhcp_packet pkt;
+    struct sockaddr_ll sll;
+    uint32_t sum;
+
+    if (len < 300)
+        len = 300; /* minimum BOOTP size; some relays insist */
+
+    memset(&pkt, 0, sizeof(pkt));
+    memcpy(&pkt.msg, m, len);
+
+    pkt.udp.source = htons(DHCP_CLIENT_PORT);
+    pkt.udp.dest = htons(DHCP_SERVER_PORT);
+    pkt.udp.len = htons(sizeof(pkt.udp) + len);
+
+    pkt.ip.saddr = src.s_addr;
+    pkt.ip.daddr = dst.s_addr;
+
+    /* UDP checksum over the pseudo header, header and payload */
+    sum = IPPROTO_UDP + sizeof(pkt.udp) + len;
+    sum += (ntohl(src.s_addr) >> 16) + (ntohl(src.s_addr) & 0xffff);
+    sum += (ntohl(dst.s_addr) >> 16) + (ntohl(dst.s_addr) & 0xffff);
+    pkt.udp.check = checksum(&pkt.udp, sizeof(pkt.udp) + len, sum);
+
+    pkt.ip.version = 4;
+    pkt.ip.ihl = sizeof(pkt.ip) >> 2;
+    pkt.ip.tot_len = htons(sizeof(pkt.ip) + sizeof(pkt.udp) + len);
+    pkt.ip.ttl = IPDEFTTL;
+    pkt.ip.protocol = IPPROTO_UDP;
+    pkt.ip.check = checksum(&pkt.ip, sizeof(pkt.ip), 0);
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    sll.sll_ifindex = e->ifindex;
+    sll.sll_halen = ETH_ALEN;
+    memset(sll.sll_addr, 0xff, ETH_ALEN);
+
+    if (sendto(e->raw_fd, &pkt, sizeof(pkt.ip) + sizeof(pkt.udp) + len, 0,
+               (struct sockaddr *) &sll, sizeof(sll)) < 0) {
+        di_warning("dhcp: send on %s failed: %s", e->iface, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Send a message to the server (or broadcast) from the bound address. */
+static int send_udp(struct dhcp_engine *e, struct dhcp_msg *m, size_t len,
+                    struct in_addr to)
+{
+    struct sockaddr_in sin;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(DHCP_SERVER_PORT);
+    sin.sin_addr = to;
+
+    if (sendto(e->udp_fd, m, len, 0, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+        di_warning("dhcp: send on %s failed: %s", e->iface, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read one reply for our transaction into m.  Returns its length, or 0
+ * if what arrived was not for us.
+ */
+static size_t recv_msg(struct dhcp_engine *e, int fd, struct dhcp_msg *m)
+{
+    union {
+        struct dhcp_packet pkt;
+        uint8_t raw[sizeof(struct dhcp_packet) + 64];
+    } buf;
+    uint8_t *msg = buf.raw;
+    ssize_t len = recv(fd, &buf, sizeof(buf), MSG_DONTWAIT);
+
+    if (len <= 0)
+        return 0;
+
+    if (fd == e->raw_fd) {
+        size_t hl = buf.pkt.ip.ihl << 2;
+        size_t ul;
+
+        if ((size_t) len < hl + sizeof(struct udphdr))
+            return 0;
+        msg = buf.raw + hl;
+        ul = ntohs(((struct udphdr *) msg)->len);
+        if (ul < sizeof(struct udphdr) || ul > len - hl)
+            return 0;
+        msg += sizeof(struct udphdr);
+        len = ul - sizeof(struct udphdr);
+    }
+
+    if ((size_t) len < DHCP_FIXED_LEN)
+        return 0;
+    if ((size_t) len > sizeof(*m))
+        len = sizeof(*m);
+    memcpy(m, msg, len);
+
+    if (m->op != 2 || m->xid != e->xid ||
+        memcmp(m->chaddr, e->hwaddr, ETH_ALEN) != 0 ||
+        m->magic != htonl(DHCP_MAGIC))
+        return 0;
+
+    return len;
+}
+
+static void copy_addrs(struct in_addr *dst, const uint8_t *p, int len)
+{
+    int i, n = MIN(len / 4, DHCP_MAX_ADDRS);
+
+    for (i = 0; i < n; i++)
+        memcpy(&dst[i], p + 4 * i, 4);
+    dst[n].s_addr = 0;
+}
+
+static void copy_string(char *dst, size_t size, const uint8_t *p, int len)
+{
+    if ((size_t) len >= size)
+        len = size - 1;
+    memcpy(dst, p, len);
+    dst[len] = '\0';
+}
+
+/* Walk one option area.  Returns the overload flags found, if any. */
+static int parse_area(const uint8_t *p, size_t len, struct dhcp_lease *l, int *type)
+{
+    const uint8_t *end = p + len;
+    int overload = 0;
+
+    while (p < end && *p != OPT_END) {
+        int code = *p++, olen;
+
+        if (code == OPT_PAD)
+            continue;
+        if (p >= end || p + 1 + *p > end)
+            break;
+        olen = *p++;
+
+        switch (code) {
+        case OPT_MSG_TYPE:
+            if (olen == 1)
+                *type = p[0];
+            break;
+        case OPT_SUBNET_MASK:
+            if (olen == 4)
+                memcpy(&l->netmask, p, 4);
+            break;
+        case OPT_BROADCAST:
+            if (olen == 4)
+                memcpy(&l->broadcast, p, 4);
+            break;
+        case OPT_ROUTER:
+            if (olen >= 4)
+                memcpy(&l->router, p, 4);
+            break;
+        case OPT_SERVER_ID:
+            if (olen == 4)
+                memcpy(&l->server, p, 4);
+            break;
+        case OPT_DNS:
+            copy_addrs(l->nameservers, p, olen);
+            break;
+        case OPT_NTP:
+            copy_addrs(l->ntp_servers, p, olen);
+            break;
+        case OPT_DOMAIN:
+            copy_string(l->domain, sizeof(l->domain), p, olen);
+            break;
+        case OPT_HOSTNAME:
+            copy_string(l->hostname, sizeof(l->hostname), p, olen);
+            break;
+        case OPT_LEASE_TIME:
+        case OPT_T1:
+        case OPT_T2:
+            if (olen == 4) {
+                uint32_t v;
+
+                memcpy(&v, p, 4);
+                v = ntohl(v);
+                if (code == OPT_LEASE_TIME)
+                    l->lease_time = v;
+                else if (code == OPT_T1)
+                    l->t1 = v;
+                else
+                    l->t2 = v;
+            }
+            break;
+        case OPT_MTU:
+            if (olen == 2)
+                l->mtu = (p[0] << 8) | p[1];
+            break;
+        case OPT_OVERLOAD:
+            if (olen == 1)
+                overload = p[0];
+            break;
+        case OPT_RAPID_COMMIT:
+            l->rapid_commit = 1;
+            break;
+        }
+        p += olen;
+    }
+
+    return overload;
+}
+
+/* Pull the lease out of a reply.  Returns the DHCP message type. */
+static int parse_msg(const struct dhcp_msg *m, size_t len, struct dhcp_lease *l)
+{
+    int type = 0, overload;
+
+    memset(l, 0, sizeof(*l));
+    l->addr.s_addr = m->yiaddr;
+
+    overload = parse_area(m->options, len - DHCP_FIXED_LEN, l, &type);
+    if (overload & 1)
+        parse_area((const uint8_t *) m->file, sizeof(m->file), l, &type);
+    if (overload & 2)
+        parse_area((const uint8_t *) m->sname, sizeof(m->sname), l, &type);
+
+    if (!l->netmask.s_addr) {
+        /* No mask given: fall back to the class of the address */
+        uint32_t a = ntohl(l->addr.s_addr);
+
+        l->netmask.s_addr = htonl(a < 0x80000000 ? 0xff000000 :
+                                  a < 0xc0000000 ? 0xffff0000 : 0xffffff00);
+    }
+    if (!l->broadcast.s_addr)
+        l->broadcast.s_addr = l->addr.s_addr | ~l->netmask.s_addr;
+
+    if (!l->lease_time)
+        l->lease_time = 0xffffffff; /* infinite */
+    if (l->lease_time != 0xffffffff) {
+        if (!l->t1 || l->t1 >= l->lease_time)
+            l->t1 = l->lease_time / 2;
+        if (!l->t2 || l->t2 >= l->lease_time || l->t2 < l->t1)
+            l->t2 = l->lease_time / 8 * 7;
+    }
+
+    return type;
+}
+
+/*
+ * Wait up to wait_ms on fd for a reply of one of the wanted types (a
+ * bitmask of 1 << type).  Returns the type received, 0 on timeout, -1 if
+ * a signal or the race coordinator asked us to stop.
+ */
+static int wait_reply(struct dhcp_engine *e, int fd, int wanted, int wait_ms,
+                      struct dhcp_lease *l)
+{
+    struct pollfd pfd[2] = { { fd, POLLIN, 0 }, { engine_ctl_fd, POLLIN, 0 } };
+    struct timespec start;
+    struct dhcp_msg m;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        long left = wait_ms - elapsed_ms(&start);
+        size_t len;
+        int type;
+
+        if (got_term || got_release)
+            return -1;
+        if (left <= 0)
+            return 0;
+
+        if (poll(pfd, engine_ctl_fd >= 0 ? 2 : 1, left) <= 0)
+            continue;
+        if (pfd[1].revents)
+            return -1;
+
+        while ((len = recv_msg(e, fd, &m)) > 0) {
+            type = parse_msg(&m, len, l);
+            if (type > 0 && type < 32 && (wanted & (1 << type)))
+                return type;
+        }
+    }
+}
+
+/* interval, made longer or shorter at random by up to dhcp_backoff.jitter
+ * percent (RFC 2131 4.1) */
+static int jittered(int interval)
+{
+    int spread = interval / 100 * dhcp_backoff.jitter;
+
+    if (spread <= 0)
+        return interval;
+    return interval - spread + random() % (2 * spread + 1);
+}
+
+static int backoff(int interval)
+{
+    return MIN(interval * 2, dhcp_backoff.max);
+}
+
+static void new_exchange(struct dhcp_engine *e)
+{
+    e->xid = random();
+    clock_gettime(CLOCK_MONOTONIC, &e->start);
+}
+
+/*
+ * The lease cache: the last lease on each interface, kept across netcfg
+ * runs in DHCP_LEASE_DIR, one file per hardware address.  The client-id
+ * it was granted to is recorded too, and has to match for it to be used.
+ * Expiry is in CLOCK_BOOTTIME seconds, which setting the clock during
+ * the install doesn't disturb.
+ */
+static void lease_cache_path(struct dhcp_engine *e, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%02x%02x%02x%02x%02x%02x.lease", DHCP_LEASE_DIR,
+             e->hwaddr[0], e->hwaddr[1], e->hwaddr[2],
+             e->hwaddr[3], e->hwaddr[4], e->hwaddr[5]);
+}
+
+static void format_client_id(struct dhcp_engine *e, char *buf)
+{
+    uint8_t id[ETH_ALEN + 1];
+    size_t i, len = client_id(e, id);
+
+    for (i = 0; i < len; i++)
+        buf += sprintf(buf, "%s%02x", i ? ":" : "", id[i]);
+}
+
+static long boot_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    return now.tv_sec;
+}
+
+/* Remember e's lease for the next run. */
+static void cache_lease(struct dhcp_engine *e)
+{
+    struct dhcp_lease *l = &e->lease;
+    char path[sizeof(DHCP_LEASE_DIR) + 32], tmp[sizeof(path) + 4];
+    char id[3 * (ETH_ALEN + 1)], a[INET_ADDRSTRLEN], s[INET_ADDRSTRLEN];
+    long expires = 0; /* never */
+    FILE *fp;
+
+    if (l->lease_time != 0xffffffff)
+        expires = boot_seconds() + l->lease_time - elapsed_ms(&l->start) / 1000;
+
+    lease_cache_path(e, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.new", path);
+    format_client_id(e, id);
+    inet_ntop(AF_INET, &l->addr, a, sizeof(a));
+    inet_ntop(AF_INET, &l->server, s, sizeof(s));
+
+    if (!(fp = fopen(tmp, "w")))
+        return;
+    fprintf(fp, "client-id=%s\naddress=%s\nserver=%s\nexpires=%ld\n",
+            id, a, s, expires);
+    if (fclose(fp) != 0 || rename(tmp, path) < 0)
+        unlink(tmp);
+}
+
+/*
+ * Look up the cached lease for e.  Returns 0 and fills in addr and server
+ * if there is one for this client-id with time left on it.
+ */
+static int cached_lease(struct dhcp_engine *e, struct in_addr *addr,
+                        struct in_addr *server)
+{
+    char path[sizeof(DHCP_LEASE_DIR) + 32], line[128], key[32], value[64];
+    char id[3 * (ETH_ALEN + 1)];
+    int id_ok = 0;
+    long expires = -1;
+    FILE *fp;
+
+    lease_cache_path(e, path, sizeof(path));
+    if (!(fp = fopen(path, "r")))
+        return -1;
+
+    format_client_id(e, id);
+    addr->s_addr = server->s_addr = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%31[^=]=%63s", key, value) != 2)
+            continue;
+        if (!strcmp(key, "client-id"))
+            id_ok = !strcmp(value, id);
+        else if (!strcmp(key, "address"))
+            inet_pton(AF_INET, value, addr);
+        else if (!strcmp(key, "server"))
+            inet_pton(AF_INET, value, server);
+        else if (!strcmp(key, "expires"))
+            expires = atol(value);
+    }
+    fclose(fp);
+
+    if (!id_ok || !addr->s_addr || expires < 0 ||
+        (expires > 0 && expires <= boot_seconds()))
+        return -1;
+    return 0;
+}
+
+static void forget_lease(struct dhcp_engine *e)
+{
+    char path[sizeof(DHCP_LEASE_DIR) + 32];
+
+    lease_cache_path(e, path, sizeof(path));
+    unlink(path);
+}
+
+/*
+ * INIT-REBOOT (RFC 2131 3.2): ask for the cached address straight away,
+ * skipping DISCOVER and the server's offer delay.  Returns 0 with
+ * e->lease filled in, 1 to go on with discovery, or -1 if told to stop.
+ */
+static int engine_reboot(struct dhcp_engine *e, long timeout_ms)
+{
+    struct in_addr addr, server;
+    struct dhcp_msg m;
+    int interval = DHCP_REBOOT_INTERVAL, tries, type;
+    size_t len;
+
+    if (cached_lease(e, &addr, &server) < 0)
+        return 1;
+
+    di_info("dhcp: asking for %s again on %s", inet_ntoa(addr), e->iface);
+    new_exchange(e);
+
+    for (tries = 0; tries < DHCP_REBOOT_TRIES; tries++) {
+        int wait = jittered(interval);
+
+        if (timeout_ms && elapsed_ms(&e->start) + wait > timeout_ms)
+            break;
+
+        len = build_msg(e, &m, DHCPREQUEST, no_addr, addr, no_addr);
+        send_raw(e, &m, len, no_addr, bcast_addr);
+
+        type = wait_reply(e, e->raw_fd, (1 << DHCPACK) | (1 << DHCPNAK),
+                          wait, &e->lease);
+        if (type < 0)
+            return -1;
+        if (type == DHCPACK && e->lease.addr.s_addr == addr.s_addr) {
+            clock_gettime(CLOCK_MONOTONIC, &e->lease.start);
+            if (!e->lease.server.s_addr)
+                e->lease.server = server;
+            return 0;
+        }
+        if (type) {
+            di_info("dhcp: %s refused on %s", inet_ntoa(addr), e->iface);
+            forget_lease(e);
+            return 1;
+        }
+        interval *= 2;
+    }
+
+    return 1;
+}
+
+/*
+ * Go through DISCOVER/OFFER/REQUEST/ACK on the packet socket until a
+ * lease is acknowledged or timeout_ms (0 for no limit) runs out, after
+ * first asking for the cached lease back if there is one.  With rapid
+ * commit, a server may answer the DISCOVER with an ACK straight away.
+ * Returns 0 with e->lease filled in, or -1.
+ */
+static int engine_acquire(struct dhcp_engine *e, long timeout_ms)
+{
+    struct timespec begin;
+    struct dhcp_lease offer;
+    struct dhcp_msg m;
+    int interval = dhcp_backoff.initial;
+    int wanted = 1 << DHCPOFFER;
+
+    if (dhcp_engine_rapid_commit)
+        wanted |= 1 << DHCPACK;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    switch (engine_reboot(e, timeout_ms)) {
+    case 0:
+        return 0;
+    case -1:
+        return -1;
+    }
+    new_exchange(e);
+
+    while (!timeout_ms || elapsed_ms(&begin) < timeout_ms) {
+        long left = timeout_ms ? timeout_ms - elapsed_ms(&begin) : interval;
+        int type, tries;
+        size_t len;
+
+        len = build_msg(e, &m, DHCPDISCOVER, no_addr, no_addr, no_addr);
+        send_raw(e, &m, len, no_addr, bcast_addr);
+
+        type = wait_reply(e, e->raw_fd, wanted, MIN(jittered(interval), left),
+                          &offer);
+        if (type < 0)
+            return -1;
+        if (type == DHCPACK && offer.rapid_commit) {
+            di_info("dhcp: rapid commit of %s on %s", inet_ntoa(offer.addr), e->iface);
+            e->lease = offer;
+            clock_gettime(CLOCK_MONOTONIC, &e->lease.start);
+            return 0;
+        }
+        if (type != DHCPOFFER) {
+            /* Nothing, or an ACK we didn't ask for (RFC 4039 4) */
+            interval = backoff(interval);
+            continue;
+        }
+
+        di_info("dhcp: offer of %s on %s", inet_ntoa(offer.addr), e->iface);
+
+        interval = dhcp_backoff.initial;
+        for (tries = 0; tries < DHCP_REQUEST_TRIES; tries++) {
+            len = build_msg(e, &m, DHCPREQUEST, no_addr, offer.addr, offer.server);
+            send_raw(e, &m, len, no_addr, bcast_addr);
+
+            type = wait_reply(e, e->raw_fd, (1 << DHCPACK) | (1 << DHCPNAK),
+                              jittered(interval), &e->lease);
+            if (type < 0)
+                return -1;
+            if (type == DHCPACK) {
+                clock_gettime(CLOCK_MONOTONIC, &e->lease.start);
+                if (!e->lease.server.s_addr)
+                    e->lease.server = offer.server;
+                return 0;
+            }
+            if (type == DHCPNAK) {
+                di_info("dhcp: offer on %s withdrawn", e->iface);
+                break;
+            }
+            interval = backoff(interval);
+        }
+
+        /* Start over with a new transaction */
+        interval = dhcp_backoff.initial;
+        new_exchange(e);
+    }
+
+    return -1;
+}
+
+static int mask_to_prefix(struct in_addr mask)
+{
+    uint32_t m = ntohl(mask.s_addr);
+    int prefix = 0;
+
+    while (m & 0x80000000) {
+        prefix++;
+        m <<= 1;
+    }
+    return prefix;
+}
+
+/* Configure the interface from the lease. */
+static int apply_lease(struct dhcp_engine *e)
+{
+    struct dhcp_lease *l = &e->lease;
+    int prefix = mask_to_prefix(l->netmask);
+    int ret;
+
+    ret = netlink_configure_ipv4(e->iface, l->addr, prefix, l->broadcast,
+                                 no_addr, l->router);
+    if (ret < 0) {
+        char buf[256], a[INET_ADDRSTRLEN], b[INET_ADDRSTRLEN];
+
+        inet_ntop(AF_INET, &l->addr, a, sizeof(a));
+        inet_ntop(AF_INET, &l->broadcast, b, sizeof(b));
+        snprintf(buf, sizeof(buf), "ip addr flush dev %s && "
+                 "ip addr add %s/%d broadcast %s dev %s",
+                 e->iface, a, prefix, b, e->iface);
+        ret = di_exec_shell_log(buf);
+        if (ret == 0 && l->router.s_addr) {
+            snprintf(buf, sizeof(buf), "ip route add default via %s dev %s",
+                     inet_ntoa(l->router), e->iface);
+            ret = di_exec_shell_log(buf);
+        }
+    }
+
+    if (ret)
+        di_warning("dhcp: could not configure %s", e->iface);
+    return ret;
+}
+
+static void record_addrs(FILE *fp, const char *key, const struct in_addr *a)
+{
+    int i;
+
+    fprintf(fp, "%s=", key);
+    for (i = 0; a[i].s_addr; i++)
+        fprintf(fp, "%s%s", i ? " " : "", inet_ntoa(a[i]));
+    fprintf(fp, "\n");
+}
+
+/*
+ * Pass on what the server told us: resolv.conf for name resolution from
+ * here on, and the rest in DHCP_LEASE_FILE for netcfg to pick up.
+ */
+static void write_lease_files(struct dhcp_engine *e)
+{
+    struct dhcp_lease *l = &e->lease;
+    FILE *fp;
+
+    if (l->nameservers[0].s_addr)
+        netcfg_write_resolv(l->domain, l->nameservers);
+
+    if (!(fp = fopen(DHCP_LEASE_FILE ".new", "w"))) {
+        di_warning("dhcp: could not write lease: %s", strerror(errno));
+        return;
+    }
+
+    fprintf(fp, "interface=%s\n", e->iface);
+    fprintf(fp, "address=%s\n", inet_ntoa(l->addr));
+    fprintf(fp, "netmask=%s\n", inet_ntoa(l->netmask));
+    fprintf(fp, "broadcast=%s\n", inet_ntoa(l->broadcast));
+    fprintf(fp, "routers=%s\n", l->router.s_addr ? inet_ntoa(l->router) : "");
+    record_addrs(fp, "dns", l->nameservers);
+    fprintf(fp, "domain=%s\n", l->domain);
+    fprintf(fp, "hostname=%s\n", l->hostname);
+    record_addrs(fp, "ntp", l->ntp_servers);
+    if (l->mtu)
+        fprintf(fp, "mtu=%d\n", l->mtu);
+    fprintf(fp, "server=%s\n", inet_ntoa(l->server));
+    if (l->lease_time == 0xffffffff)
+        fprintf(fp, "lease=infinite\n");
+    else
+        fprintf(fp, "lease=%u\nrenew=%u\nrebind=%u\n",
+                l->lease_time, l->t1, l->t2);
+
+    if (fclose(fp) != 0 || rename(DHCP_LEASE_FILE ".new", DHCP_LEASE_FILE) < 0) {
+        di_warning("dhcp: could not write lease: %s", strerror(errno));
+        unlink(DHCP_LEASE_FILE ".new");
+    }
+}
+
+static void log_lease(struct dhcp_engine *e)
+{
+    struct dhcp_lease *l = &e->lease;
+    char a[INET_ADDRSTRLEN], s[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &l->addr, a, sizeof(a));
+    inet_ntop(AF_INET, &l->server, s, sizeof(s));
+    di_info("dhcp: %s/%d on %s from %s, lease %u seconds", a,
+            mask_to_prefix(l->netmask), e->iface, s, l->lease_time);
+}
+
+static void release_lease(struct dhcp_engine *e)
+{
+    struct dhcp_msg m;
+    size_t len;
+
+    if (e->udp_fd < 0 && udp_open(e) < 0)
+        return;
+
+    new_exchange(e);
+    len = build_msg(e, &m, DHCPRELEASE, e->lease.addr, no_addr, e->lease.server);
+    send_udp(e, &m, len, e->lease.server);
+    forget_lease(e);
+    di_info("dhcp: released %s on %s", inet_ntoa(e->lease.addr), e->iface);
+}
+
+static void daemon_signal(int sig)
+{
+    if (sig == SIGUSR2)
+        got_release = 1;
+    else
+        got_term = 1;
+}
+
+/*
+ * Keep the lease: renew with the server from T1, rebind with anybody
+ * from T2, and start over if it runs out.  Only returns when told to
+ * stop by a signal.
+ */
+static void engine_bound(struct dhcp_engine *e)
+{
+    struct dhcp_lease renewed;
+    struct dhcp_msg m;
+
+    for (;;) {
+        struct dhcp_lease *l = &e->lease;
+        long now = elapsed_ms(&l->start) / 1000;
+        struct in_addr to;
+        long wait;
+        size_t len;
+        int type;
+
+        if (got_term || got_release)
+            return;
+
+        if (l->lease_time == 0xffffffff) {
+            pause();
+            continue;
+        }
+
+        if (now >= (long) l->lease_time) {
+            di_warning("dhcp: lease on %s expired", e->iface);
+            if (e->udp_fd >= 0)
+                close(e->udp_fd);
+            e->udp_fd = -1;
+            netlink_flush_ipv4(e->iface);
+            if (raw_open(e) < 0 || engine_acquire(e, 0) < 0)
+                return;
+            close(e->raw_fd);
+            e->raw_fd = -1;
+            log_lease(e);
+            apply_lease(e);
+            write_lease_files(e);
+            cache_lease(e);
+            continue;
+        }
+
+        if (now < (long) l->t1) {
+            /* Sleep towards T1; a signal cuts this short */
+            poll(NULL, 0, MIN((long) l->t1 - now, DHCP_MAX_SLEEP) * 1000);
+            continue;
+        }
+
+        if (e->udp_fd < 0 && udp_open(e) < 0) {
+            poll(NULL, 0, DHCP_MIN_RENEW_INTERVAL * 1000);
+            continue;
+        }
+
+        /* Renewing goes to our server, rebinding to anyone.  Retry halfway
+         * to the next deadline, but not more often than once a minute. */
+        if (now < (long) l->t2) {
+            to = l->server;
+            wait = (l->t2 - now) / 2;
+        } else {
+            to.s_addr = INADDR_BROADCAST;
+            wait = (l->lease_time - now) / 2;
+        }
+        if (wait < DHCP_MIN_RENEW_INTERVAL)
+            wait = DHCP_MIN_RENEW_INTERVAL;
+        if (wait > DHCP_MAX_SLEEP)
+            wait = DHCP_MAX_SLEEP;
+
+        new_exchange(e);
+        len = build_msg(e, &m, DHCPREQUEST, l->addr, no_addr, no_addr);
+        send_udp(e, &m, len, to);
+
+        type = wait_reply(e, e->udp_fd, (1 << DHCPACK) | (1 << DHCPNAK),
+                          wait * 1000, &renewed);
+        if (type == DHCPACK) {
+            clock_gettime(CLOCK_MONOTONIC, &renewed.start);
+            if (!renewed.server.s_addr)
+                renewed.server = l->server;
+            if (renewed.addr.s_addr != l->addr.s_addr ||
+                renewed.router.s_addr != l->router.s_addr) {
+                e->lease = renewed;
+                apply_lease(e);
+            } else {
+                e->lease = renewed;
+            }
+            log_lease(e);
+            cache_lease(e);
+            close(e->udp_fd);
+            e->udp_fd = -1;
+        } else if (type == DHCPNAK) {
+            di_warning("dhcp: lease on %s refused on renewal", e->iface);
+            forget_lease(e);
+            e->lease.lease_time = 0; /* handled as expired above */
+        }
+    }
+}
+
+static void write_pidfile(void)
+{
+    FILE *fp;
+
+    if ((fp = fopen(DHCP_ENGINE_PIDFILE, "w"))) {
+        fprintf(fp, "%d\n", (int) getpid());
+        fclose(fp);
+    }
+}
+
+/* Become the lease daemon for e's lease, in the current process. */
+static void engine_keep(struct dhcp_engine *e) __attribute__ ((noreturn));
+static void engine_keep(struct dhcp_engine *e)
+{
+    struct sigaction sa;
+
+    setsid();
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    write_pidfile();
+
+    engine_bound(e);
+
+    if (got_release)
+        release_lease(e);
+    engine_close(e);
+    unlink(DHCP_ENGINE_PIDFILE);
+    _exit(0);
+}
+
+/* Can the built-in client work on iface? */
+int dhcp_engine_usable(const char *iface)
+{
+    struct dhcp_engine e;
+    int ok;
+
+    memset(&e, 0, sizeof(e));
+    strncpy(e.iface, iface, IFNAMSIZ - 1);
+    e.udp_fd = -1;
+
+    ok = (raw_open(&e) == 0);
+    engine_close(&e);
+    return ok;
+}
+
+/*
+ * Get a lease on iface within timeout seconds, and configure it.  Meant to
+ * be run in a child the way an external client would be: on success the
+ * lease is handed over to a daemon that keeps renewing it, and 0 is
+ * returned for the child's exit status; otherwise 1.
+ */
+int dhcp_engine_run(const char *iface, const char *hostname, int timeout)
+{
+    struct dhcp_engine e;
+    pid_t pid;
+
+    memset(&e, 0, sizeof(e));
+    strncpy(e.iface, iface, IFNAMSIZ - 1);
+    e.hostname = hostname;
+    e.udp_fd = -1;
+
+    /* Like the external clients, bring the link up ourselves;
+     * loop_setup() will just have taken it down. */
+    interface_up(e.iface);
+
+    if (raw_open(&e) < 0)
+        return 1;
+
+    if (engine_acquire(&e, timeout * 1000L) < 0) {
+        engine_close(&e);
+        return 1;
+    }
+    close(e.raw_fd);
+    e.raw_fd = -1;
+
+    log_lease(&e);
+    if (apply_lease(&e)) {
+        engine_close(&e);
+        return 1;
+    }
+    write_lease_files(&e);
+    cache_lease(&e);
+
+    if ((pid = fork()) < 0) {
+        di_warning("dhcp: could not start lease daemon: %s", strerror(errno));
+        return 0; /* the lease stands, it just won't be renewed */
+    }
+    if (pid > 0)
+        return 0;
+
+    engine_keep(&e);
+}
+
+/*
+ * Racing: one engine per interface, each in its own process, talking to a
+ * coordinator over a pair of pipes.  A worker reports 'A' when it holds an
+ * ACK (or 'F' when it gives up) and waits to be told 'C' to commit or 'R'
+ * to release.  The winner applies its lease, reports 'B' and stays on as
+ * the lease daemon.
+ */
+struct racer {
+    const char *iface;
+    pid_t pid;
+    int status_fd;              /* worker -> coordinator */
+    int ctl_fd;                 /* coordinator -> worker */
+    enum { IDLE, RUNNING, ACKED, DONE } state;
+    int acked;                  /* order in which it reported 'A' */
+};
+
+static int race_worker(const char *iface, const char *hostname, long timeout_ms,
+                       int status_fd, int ctl_fd)
+{
+    struct dhcp_engine e;
+    char cmd = 'R';
+
+    memset(&e, 0, sizeof(e));
+    strncpy(e.iface, iface, IFNAMSIZ - 1);
+    e.hostname = hostname;
+    e.udp_fd = -1;
+    engine_ctl_fd = ctl_fd;
+
+    if (raw_open(&e) < 0 || engine_acquire(&e, timeout_ms) < 0) {
+        if (write(status_fd, "F", 1) < 0) {
+            /* the coordinator is gone; nothing to tell */
+        }
+        engine_close(&e);
+        return 1;
+    }
+
+    log_lease(&e);
+    engine_ctl_fd = -1;
+    if (write(status_fd, "A", 1) < 0 || read(ctl_fd, &cmd, 1) != 1)
+        cmd = 'R';
+
+    if (cmd == 'C') {
+        close(e.raw_fd);
+        e.raw_fd = -1;
+        if (apply_lease(&e) == 0) {
+            write_lease_files(&e);
+            cache_lease(&e);
+            if (write(status_fd, "B", 1) == 1) {
+                close(status_fd);
+                close(ctl_fd);
+                engine_keep(&e);
+            }
+        }
+        netlink_flush_ipv4(e.iface);
+        if (raw_open(&e) < 0)
+            return 1;
+    }
+
+    /* Hand the lease back; we have no address, so say it on the wire */
+    new_exchange(&e);
+    {
+        struct dhcp_msg m;
+        size_t len = build_msg(&e, &m, DHCPRELEASE, e.lease.addr, no_addr,
+                               e.lease.server);
+
+        send_raw(&e, &m, len, e.lease.addr, e.lease.server);
+    }
+    forget_lease(&e);
+    di_info("dhcp: released %s on %s", inet_ntoa(e.lease.addr), e.iface);
+    engine_close(&e);
+    return 1;
+}
+
+static int start_racer(struct racer *racers, int num, int i, int mon,
+                       const char *hostname, long timeout_ms)
+{
+    struct racer *r = &racers[i];
+    int st[2], ctl[2], j;
+
+    if (pipe(st) < 0)
+        return -1;
+    if (pipe(ctl) < 0) {
+        close(st[0]);
+        close(st[1]);
+        return -1;
+    }
+
+    if ((r->pid = fork()) == 0) {
+        /* Keep only our own ends, so a dead coordinator reads as EOF */
+        for (j = 0; j < num; j++) {
+            if (j != i && racers[j].state != IDLE) {
+                close(racers[j].status_fd);
+                close(racers[j].ctl_fd);
+            }
+        }
+        if (mon >= 0)
+            close(mon);
+        close(st[0]);
+        close(ctl[1]);
+        _exit(race_worker(r->iface, hostname, timeout_ms, st[1], ctl[0]));
+    }
+
+    close(st[1]);
+    close(ctl[0]);
+    if (r->pid < 0) {
+        close(st[0]);
+        close(ctl[1]);
+        return -1;
+    }
+
+    r->status_fd = st[0];
+    r->ctl_fd = ctl[1];
+    r->state = RUNNING;
+    di_info("dhcp: racing on %s", r->iface);
+    return 0;
+}
+
+static void tell_racer(struct racer *r, char cmd)
+{
+    if ((r->state == RUNNING || r->state == ACKED) &&
+        write(r->ctl_fd, &cmd, 1) < 0) {
+        /* it has already gone */
+    }
+}
+
+static void finish_racer(struct racer *r)
+{
+    if (r->state == IDLE)
+        return;
+    close(r->status_fd);
+    close(r->ctl_fd);
+    r->state = DONE;
+}
+
+/* The racer that got its ACK first of those still holding one, or -1 */
+static int next_winner(struct racer *racers, int num)
+{
+    int i, best = -1;
+
+    for (i = 0; i < num; i++)
+        if (racers[i].state == ACKED &&
+            (best < 0 || racers[i].acked < racers[best].acked))
+            best = i;
+    return best;
+}
+
+/*
+ * Get a lease on whichever of ifaces answers first.  ifaces[0] is tried
+ * straight away; the others are brought up and join in as soon as they
+ * have carrier.  The first to hold an ACK is told to commit it; the
+ * others keep theirs until it has, in case it can't, and then the next
+ * one is committed instead.  The winner's name is left in
+ * DHCP_RACE_FILE, and the others are released and taken down again.
+ * Returns an exit status as for dhcp_engine_run().
+ */
+int dhcp_engine_race(char **ifaces, int num_ifaces, const char *hostname, int timeout)
+{
+    struct racer *racers;
+    struct pollfd *pfds;
+    struct netcfg_iface *links = NULL;
+    struct timespec begin;
+    char **pending;
+    int *pending_map;
+    pid_t *losers;
+    int num_links, mon, i, j, winner = -1, bound = 0, acks = 0;
+    long timeout_ms = timeout * 1000L;
+    FILE *fp;
+
+    racers = calloc(num_ifaces, sizeof(*racers));
+    pfds = calloc(num_ifaces + 1, sizeof(*pfds));
+    pending = calloc(num_ifaces, sizeof(*pending));
+    pending_map = calloc(num_ifaces, sizeof(*pending_map));
+    losers = calloc(num_ifaces, sizeof(*losers));
+    if (!racers || !pfds || !pending || !pending_map || !losers)
+        return 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    /* A racer that has gone must not take us down with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Subscribe first so that no carrier event is missed */
+    mon = netlink_link_monitor();
+    interfaces_up(ifaces, num_ifaces);
+    num_links = netlink_get_links(&links);
+
+    for (i = 0; i < num_ifaces; i++) {
+        racers[i].iface = ifaces[i];
+        racers[i].state = IDLE;
+
+        for (j = 0; i > 0 && j < num_links; j++)
+            if (!strcmp(links[j].name, ifaces[i]))
+                break;
+        if (i == 0 || (j < num_links && (links[j].flags & IFF_RUNNING)))
+            start_racer(racers, num_ifaces, i, mon, hostname, timeout_ms);
+    }
+    free(links);
+
+    while (!bound && elapsed_ms(&begin) < timeout_ms) {
+        int n = 0, np = 0;
+
+        for (i = 0; i < num_ifaces; i++) {
+            if (racers[i].state == RUNNING || racers[i].state == ACKED) {
+                pfds[n].fd = racers[i].status_fd;
+                pfds[n++].events = POLLIN;
+            } else if (racers[i].state == IDLE) {
+                pending_map[np] = i;
+                pending[np++] = ifaces[i];
+            }
+        }
+        if (mon >= 0 && winner < 0 && np > 0) {
+            pfds[n].fd = mon;
+            pfds[n++].events = POLLIN;
+        }
+        if (n == 0)
+            break; /* everyone gave up and nothing is left to try */
+
+        if (poll(pfds, n, timeout_ms - elapsed_ms(&begin)) <= 0)
+            continue;
+
+        /* New carrier: start a racer there */
+        if (pfds[n - 1].fd == mon && pfds[n - 1].revents) {
+            while ((i = netlink_wait_carrier(mon, pending, np, 0)) >= 0) {
+                start_racer(racers, num_ifaces, pending_map[i], mon, hostname,
+                            timeout_ms - elapsed_ms(&begin));
+                pending[i] = ""; /* don't match it again */
+            }
+        }
+
+        for (i = 0; i < num_ifaces; i++) {
+            char c;
+
+            if (racers[i].state != RUNNING && racers[i].state != ACKED)
+                continue;
+            for (j = 0; j < n; j++)
+                if (pfds[j].fd == racers[i].status_fd)
+                    break;
+            if (j == n || !pfds[j].revents)
+                continue;
+
+            if (read(racers[i].status_fd, &c, 1) != 1)
+                c = 'F';
+
+            if (c == 'A') {
+                racers[i].state = ACKED; /* held until the winner has bound */
+                racers[i].acked = acks++;
+            } else if (c == 'B' && i == winner) {
+                bound = 1;
+            } else {
+                finish_racer(&racers[i]);
+                if (i == winner)
+                    winner = -1; /* couldn't apply; try the next one */
+            }
+        }
+
+        if (!bound && winner < 0 &&
+            (winner = next_winner(racers, num_ifaces)) >= 0)
+            tell_racer(&racers[winner], 'C');
+    }
+
+    if (mon >= 0)
+        close(mon);
+
+    /* Out of time while the winner commits: let it finish rather than
+     * leave a lease daemon behind that nobody knows about.  If it doesn't
+     * bind in time, closing its pipe makes it release the lease, and it
+     * is reaped with the others. */
+    if (!bound && winner >= 0) {
+        struct pollfd pfd = { racers[winner].status_fd, POLLIN, 0 };
+        char c;
+
+        if (poll(&pfd, 1, NETCFG_DHCP_STOP_WAIT) > 0 &&
+            read(racers[winner].status_fd, &c, 1) == 1 && c == 'B') {
+            bound = 1;
+        } else {
+            finish_racer(&racers[winner]);
+            winner = -1;
+        }
+    }
+
+    /* Stop the stragglers and give the others time to send their releases */
+    for (i = 0; i < num_ifaces; i++) {
+        if (i != winner)
+            tell_racer(&racers[i], 'R');
+    }
+    for (i = 0; i < num_ifaces; i++)
+        losers[i] = i != winner ? racers[i].pid : 0;
+    reap_children(losers, num_ifaces, NETCFG_DHCP_STOP_WAIT);
+    for (i = 0; i < num_ifaces; i++)
+        finish_racer(&racers[i]);
+
+    /* Take down what we brought up, except the interface we were given */
+    for (i = 1, j = 0; i < num_ifaces; i++)
+        if (!bound || i != winner)
+            pending[j++] = ifaces[i];
+    interfaces_down(pending, j);
+    if (bound && winner != 0)
+        interface_down(ifaces[0]);
+
+    if (bound) {
+        di_info("dhcp: %s won the race", ifaces[winner]);
+        if ((fp = fopen(DHCP_RACE_FILE, "w"))) {
+            fprintf(fp, "%s\n", ifaces[winner]);
+            fclose(fp);
+        }
+    }
+
+    free(racers);
+    free(pfds);
+    free(pending);
+    free(pending_map);
+    free(losers);
+    return bound ? 0 : 1;
+}
+
+#ifdef BENCH
+/*
+ * dhcp-bench [-n] [-d delay] <iface> [timeout]
+ *
+ * Get a lease on iface the way the built-in client does, without
+ * applying it, and print one line for dhcp-bench.sh to collect:
+ *
+ *   <iface> ok|fail <ms> <DISCOVERs sent> <REQUESTs sent>
+ *
+ * -n leaves rapid commit out; -d holds off for up to delay ms, by
+ * hardware address, as netcfg/dhcp_start_delay does.  The time includes
+ * that delay.  Exits 0 if a lease was acknowledged.
+ */
+int main(int argc, char **argv)
+{
+    struct dhcp_engine e;
+    struct timespec begin;
+    int timeout = 25, ok, opt;
+
+    while ((opt = getopt(argc, argv, "nd:")) != -1) {
+        switch (opt) {
+        case 'n':
+            dhcp_engine_rapid_commit = 0;
+            break;
+        case 'd':
+            dhcp_backoff.start_delay = atoi(optarg);
+            break;
+        default:
+            return 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 2) {
+        fprintf(stderr, "dhcp-bench: Error: must pass an interface name\n");
+        return 1;
+    }
+    if (argc > 2 && (timeout = atoi(argv[2])) <= 0)
+        timeout = 25;
+
+    memset(&e, 0, sizeof(e));
+    strncpy(e.iface, argv[1], IFNAMSIZ - 1);
+    e.udp_fd = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    ok = (raw_open(&e) == 0 &&
+          poll(NULL, 0, dhcp_start_delay(e.hwaddr, ETH_ALEN)) == 0 &&
+          engine_acquire(&e, timeout * 1000L) == 0);
+    printf("%s %s %ld %d %d\n", e.iface, ok ? "ok" : "fail", elapsed_ms(&begin),
+           e.sent[DHCPDISCOVER], e.sent[DHCPREQUEST]);
+
+    engine_close(&e);
+    return ok ? 0 : 1;
+}
+#endif /* BENCH */
+
+#else /* !__linux__ */
+
+int dhcp_engine_usable(const char *iface)
+{
+    (void) iface;
+    return 0;
+}
+
+int dhcp_engine_run(const char *iface, const char *hostname, int timeout)
+{
+    (void) iface;
+    (void) hostname;
+    (void) timeout;
+    return 1;
+}
+
+int dhcp_engine_race(char **ifaces, int num_ifaces, const char *hostname, int timeout)
+{
+    (void) ifaces;
+    (void) num_ifaces;
+    (void) hostname;
+    (void) timeout;
+    return 1;
+}
+
+#endif /* __linux__ */
+
+/*
+ * Stop a lease daemon left by dhcp_engine_run(), if there is one.  Returns
+ * 1 if one was running.
+ */
+int dhcp_engine_stop(void)
+{
+    /* It only has to close its sockets */
+    return stop_pidfile(DHCP_ENGINE_PIDFILE, NETCFG_DHCP_STOP_WAIT);
+}
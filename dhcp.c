@@ -17,10 +17,18 @@
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <time.h>
 #include <netdb.h>
+#include <poll.h>
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#endif
 
 #define DHCP_OPTION_LEN 1236 /* pump 0.8.24 defines a max option size of 57,
                                 dhcp 2.0pl5 uses 1222, dhcp3 3.0.6 uses 1236 */
@@ -46,6 +54,13 @@ const char* dhclient_request_options_udhcpc[] = { "subnet",
 
 static int dhcp_exit_status = 1;
 static pid_t dhcp_pid = -1;
+static int dhcp_exit_fd = -1;   /* readable once dhcp_pid may have exited */
+static int dhcp_delay = 0;      /* ms the client holds off before starting */
+static sigset_t dhcp_saved_mask; /* signal mask before SIGCHLD was blocked */
+static int dhcp_sigchld_blocked = 0;
+
+/* Which client the last start_dhcp_client() ran */
+static enum { UNKNOWN, BUILTIN, DHCLIENT, PUMP, UDHCPC } dhcp_client = UNKNOWN;
 
 
 /*
@@ -110,6 +125,10 @@ static short no_default_route (void)
 #else
     FILE* iproute = NULL;
     char buf[256] = { 0 };
+    int ret;
+
+    if ((ret = netlink_has_default_route(NETCFG_DEFAULT_ROUTE_WAIT)) >= 0)
+        return !ret;
 
     if ((iproute = popen("ip route", "r")) != NULL) {
         while (fgets (buf, 256, iproute) != NULL) {
@@ -125,30 +144,301 @@ static short no_default_route (void)
 #endif
 }
 
+#ifdef __linux__
+/* Whether the kernel gives out pidfds; found out once, on ourselves */
+static int have_pidfd(void)
+{
+#ifdef SYS_pidfd_open
+    static int have = -1;
+    int fd;
+
+    if (have < 0) {
+        fd = syscall(SYS_pidfd_open, getpid(), 0);
+        have = fd >= 0;
+        if (fd >= 0)
+            close(fd);
+    }
+    return have;
+#else
+    return 0;
+#endif
+}
+#endif
+
 /*
- * Signal handler for DHCP client child
- *
- * When the child exits (either because it failed to obtain a
- * lease or because it succeeded and daemonized itself), this
- * gets the child's exit status and sets dhcp_pid to -1
+ * Without pidfds, the client's exit is seen through a signalfd, so
+ * SIGCHLD has to be blocked from before the fork, in case the client
+ * exits straight away, until the client has been reaped.  Whatever else
+ * netcfg runs in the meantime inherits the blocked SIGCHLD, so it is only
+ * blocked when needed and put back as soon as the client is collected.
  */
-static void dhcp_client_sigchld(int sig __attribute__ ((unused)))
+static void block_sigchld(void)
+{
+#ifdef __linux__
+    sigset_t mask;
+
+    if (dhcp_sigchld_blocked || have_pidfd())
+        return;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, &dhcp_saved_mask) == 0)
+        dhcp_sigchld_blocked = 1;
+#endif
+}
+
+static void unblock_sigchld(void)
 {
-    di_debug("dhcp_client_sigchld() called");
+    if (dhcp_sigchld_blocked)
+        sigprocmask(SIG_SETMASK, &dhcp_saved_mask, NULL);
+    dhcp_sigchld_blocked = 0;
+}
+
+/*
+ * Get a descriptor that becomes readable when the DHCP client exits: a
+ * pidfd where the kernel has them, otherwise a signalfd for SIGCHLD if
+ * block_sigchld() blocked it.  Returns -1 if neither is available and
+ * the caller has to poll.
+ */
+static int dhcp_client_exit_fd(pid_t pid)
+{
+#ifdef __linux__
+    sigset_t mask;
+    int fd = -1;
+
+#ifdef SYS_pidfd_open
+    fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd >= 0)
+        return fd;
+#else
+    (void) pid;
+#endif
+
+    if (!dhcp_sigchld_blocked)
+        return -1;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    return fd;
+#else
+    (void) pid;
+    return -1;
+#endif
+}
+
+/*
+ * Collect the DHCP client's exit status if it has exited.  Returns 1 once
+ * there is no client left running, 0 otherwise.
+ */
+static int reap_dhcp_client(void)
+{
+    int status;
+
     if (dhcp_pid <= 0)
-        /* Already cleaned up */
+        return 1;
+
+#ifdef __linux__
+    if (dhcp_exit_fd >= 0) {
+        /* Drain pending SIGCHLDs; a pidfd just reads as an error */
+        struct signalfd_siginfo si;
+
+        while (read(dhcp_exit_fd, &si, sizeof(si)) > 0)
+            ;
+    }
+#endif
+
+    if (waitpid(dhcp_pid, &status, WNOHANG) != dhcp_pid)
+        return 0;
+
+    di_debug("DHCP client %i exited with status %i", dhcp_pid, status);
+    dhcp_exit_status = status;
+    dhcp_pid = -1;
+
+    if (dhcp_exit_fd >= 0)
+        close(dhcp_exit_fd);
+    dhcp_exit_fd = -1;
+    unblock_sigchld();
+
+    return 1;
+}
+
+
+/*
+ * The interfaces to race DHCP on: the chosen one first, then every other
+ * wired interface.  Returns how many there are.
+ */
+static int get_race_ifaces (char ***race)
+{
+    char **ifs;
+    int num, i, n = 1;
+
+    num = get_all_ifs(1, &ifs);
+    if (!(*race = malloc((num + 1) * sizeof(**race)))) {
+        n = 0;
+        goto out;
+    }
+
+    (*race)[0] = strdup(interface);
+    for (i = 0; i < num; i++) {
+        const struct netcfg_iface *e = netcfg_find_iface(ifs[i]);
+
+        if (!strcmp(ifs[i], interface) || (e && e->wireless))
+            continue;
+        (*race)[n++] = strdup(ifs[i]);
+    }
+
+ out:
+    for (i = 0; i < num; i++)
+        free(ifs[i]);
+    free(ifs);
+    return n;
+}
+
+static void free_race_ifaces (char **race, int num)
+{
+    int i;
+
+    for (i = 0; i < num; i++)
+        free(race[i]);
+    free(race);
+}
+
+/*
+ * After a race, switch to whichever interface got the lease.
+ */
+static void take_race_winner (void)
+{
+    char name[IFNAMSIZ + 1] = { 0 };
+    FILE *fp;
+
+    if (!(fp = fopen(DHCP_RACE_FILE, "r")))
         return;
+    if (fgets(name, sizeof(name), fp) != NULL) {
+        name[strcspn(name, "\n")] = '\0';
+        if (!empty_str(name) && strcmp(name, interface)) {
+            di_info("DHCP race won by %s; using it instead of %s", name, interface);
+            free(interface);
+            interface = strdup(name);
+        }
+    }
+    fclose(fp);
+    unlink(DHCP_RACE_FILE);
+}
 
-    /*
-     * I hope it's OK to call waitpid() from the SIGCHLD signal handler
-     */
-    di_debug("Waiting for dhcp_pid = %i", dhcp_pid);
-    waitpid(dhcp_pid, &dhcp_exit_status, WNOHANG);
-    if (WIFEXITED(dhcp_exit_status)) {
-        dhcp_pid = -1;
+/*
+ * The lease a DHCP client hands over in DHCP_LEASE_FILE: one key=value
+ * per line, lists separated by spaces.  The keys are interface, address,
+ * netmask, broadcast, routers, dns, domain, hostname, ntp, mtu, server,
+ * and lease, renew and rebind in seconds ("infinite" for no expiry).
+ * Only what netcfg itself needs is kept here.
+ */
+struct lease_record {
+    struct in_addr address;
+    struct in_addr *nameservers;        /* 0-terminated, or NULL if none */
+    char domain[_UTSNAME_LENGTH + 1];
+    char hostname[MAXHOSTNAMELEN + 1];
+    char ntp[DHCP_OPTION_LEN + 1];
+};
+
+static struct lease_record dhcp_lease;
+
+/* Read DHCP_LEASE_FILE into dhcp_lease.  Returns 0 if there was one. */
+static int read_lease_record (void)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *fp;
+
+    free(dhcp_lease.nameservers);
+    memset(&dhcp_lease, 0, sizeof(dhcp_lease));
+
+    if (!(fp = fopen(DHCP_LEASE_FILE, "r")))
+        return -1;
+
+    while ((len = getline(&line, &size, fp)) > 0) {
+        char *value = strchr(line, '=');
+
+        if (!value)
+            continue;
+        *value++ = '\0';
+        value[strcspn(value, "\n")] = '\0';
+
+        if (!strcmp(line, "address"))
+            inet_pton(AF_INET, value, &dhcp_lease.address);
+        else if (!strcmp(line, "domain"))
+            snprintf(dhcp_lease.domain, sizeof(dhcp_lease.domain), "%s", value);
+        else if (!strcmp(line, "hostname"))
+            snprintf(dhcp_lease.hostname, sizeof(dhcp_lease.hostname), "%s", value);
+        else if (!strcmp(line, "ntp"))
+            snprintf(dhcp_lease.ntp, sizeof(dhcp_lease.ntp), "%s", value);
+        else if (!strcmp(line, "dns") && *value) {
+            /* Every nameserver given, however many there are */
+            int n = 0, max = strlen(value) / 8 + 2;
+            char *tok;
+
+            free(dhcp_lease.nameservers);
+            if (!(dhcp_lease.nameservers = calloc(max, sizeof(struct in_addr))))
+                continue;
+            for (tok = strtok(value, " "); tok && n < max - 1; tok = strtok(NULL, " "))
+                if (inet_pton(AF_INET, tok, &dhcp_lease.nameservers[n]) == 1)
+                    n++;
+            if (!n) {
+                free(dhcp_lease.nameservers);
+                dhcp_lease.nameservers = NULL;
+            }
+        }
     }
+
+    free(line);
+    fclose(fp);
+    return 0;
 }
 
+/* A preseeded number, or def if it isn't one */
+static int get_number (struct debconfclient *client, const char *template, int def)
+{
+    char *end;
+    long n;
+
+    debconf_get(client, template);
+    n = strtol(client->value, &end, 10);
+    if (end == client->value || *end || n < 0 || n > 600000)
+        return def;
+    return n;
+}
+
+/*
+ * Read the retransmission policy, and work out from the interface's
+ * hardware address how long to hold off before starting.
+ */
+static void get_dhcp_backoff (struct debconfclient *client)
+{
+    dhcp_backoff.initial = get_number(client, "netcfg/dhcp_initial_interval", 1000);
+    dhcp_backoff.max = get_number(client, "netcfg/dhcp_max_interval", 4000);
+    dhcp_backoff.jitter = get_number(client, "netcfg/dhcp_jitter", 25);
+    dhcp_backoff.start_delay = get_number(client, "netcfg/dhcp_start_delay", 0);
+
+    if (dhcp_backoff.initial < 100)
+        dhcp_backoff.initial = 100;
+    if (dhcp_backoff.max < dhcp_backoff.initial)
+        dhcp_backoff.max = dhcp_backoff.initial;
+    if (dhcp_backoff.jitter > 100)
+        dhcp_backoff.jitter = 100;
+
+    dhcp_delay = 0;
+#ifndef __GNU__
+    {
+        const struct netcfg_iface *iface = netcfg_find_iface(interface);
+
+        if (iface)
+            dhcp_delay = dhcp_start_delay(iface->hwaddr, iface->hwaddr_len);
+    }
+#endif
+    if (dhcp_delay)
+        di_info("Holding DHCP on %s off for %d ms", interface, dhcp_delay);
+}
 
 /*
  * This function will start whichever DHCP client is available
@@ -162,11 +452,16 @@ int start_dhcp_client (struct debconfclient *client, char* dhostname)
     const char **ptr;
     char **arguments;
     int options_count;
-    enum { DHCLIENT, PUMP, UDHCPC } dhcp_client;
     int dhcp_seconds;
     char dhcp_seconds_str[16];
-
-    if (access("/sbin/dhclient", F_OK) == 0)
+    char interval_str[16];
+    char **race = NULL;
+    int num_race = 0;
+
+    debconf_get(client, "netcfg/dhcp_builtin");
+    if (!strcmp(client->value, "true") && dhcp_engine_usable(interface))
+        dhcp_client = BUILTIN;
+    else if (access("/sbin/dhclient", F_OK) == 0)
 		dhcp_client = DHCLIENT;
     else if (access("/sbin/pump", F_OK) == 0)
         dhcp_client = PUMP;
@@ -178,16 +473,57 @@ int start_dhcp_client (struct debconfclient *client, char* dhostname)
         exit(1);
     }
 
+    if (dhcp_client == BUILTIN) {
+        debconf_get(client, "netcfg/dhcp_rapid_commit");
+        dhcp_engine_rapid_commit = !strcmp(client->value, "true");
+    }
+
     debconf_get(client, "netcfg/dhcp_timeout");
     dhcp_seconds = atoi(client->value);
-    snprintf(dhcp_seconds_str, sizeof dhcp_seconds_str, "%d", dhcp_seconds-1);
+    get_dhcp_backoff(client);
+
+    /* The external clients only count in seconds, and randomize or
+     * don't as they see fit; udhcpc has no backoff at all. */
+    snprintf(interval_str, sizeof interval_str, "%d",
+             (dhcp_backoff.initial + 999) / 1000);
+    snprintf(dhcp_seconds_str, sizeof dhcp_seconds_str, "%d",
+             MAX(1, (dhcp_seconds - 1) / atoi(interval_str)));
+
+    /* Racing needs a client that can hold an ACK until told what to do
+     * with it, so only the built-in one does it. */
+    debconf_get(client, "netcfg/dhcp_race");
+    if (!strcmp(client->value, "true")) {
+        if (dhcp_client == BUILTIN)
+            num_race = get_race_ifaces(&race);
+        else
+            di_info("Not racing DHCP: needs the built-in client");
+    }
+    unlink(DHCP_RACE_FILE);
+    unlink(DHCP_LEASE_FILE);
+
+    block_sigchld();
+
+    dhcp_exit_status = 1;
 
     if ((dhcp_pid = fork()) == 0) { /* child */
+        unblock_sigchld();
+
         /* disassociate from debconf */
         fclose(client->out);
 
+        if (dhcp_delay)
+            poll(NULL, 0, dhcp_delay);
+
         /* get dhcp lease */
         switch (dhcp_client) {
+        case BUILTIN:
+            if (num_race > 1)
+                _exit(dhcp_engine_race(race, num_race, dhostname, dhcp_seconds));
+            _exit(dhcp_engine_run(interface, dhostname, dhcp_seconds));
+
+        case UNKNOWN:
+            break;
+
         case PUMP:
             if (dhostname)
                 execlp("pump", "pump", "-i", interface, "-h", dhostname, NULL);
@@ -216,11 +552,14 @@ int start_dhcp_client (struct debconfclient *client, char* dhostname)
                     fprintf(dc, "send host-name \"%s\";\n", dhostname);
                 }
                 fprintf(dc, "timeout %d;\n", dhcp_seconds);
-                fprintf(dc, "initial-interval 1;\n");
+                fprintf(dc, "initial-interval %s;\n", interval_str);
+                fprintf(dc, "backoff-cutoff %d;\n",
+                        (dhcp_backoff.max + 999) / 1000);
                 fclose(dc);
             }
 
-            execlp("dhclient", "dhclient", "-1", interface, "-cf", DHCLIENT_CONF, NULL);
+            execlp("dhclient", "dhclient", "-1", interface, "-cf", DHCLIENT_CONF,
+                   "-pf", DHCLIENT_PIDFILE, NULL);
             break;
 
         case UDHCPC:
@@ -230,7 +569,7 @@ int start_dhcp_client (struct debconfclient *client, char* dhostname)
                 options_count++;
 
             arguments = malloc((options_count * 2  /* -O <option> repeatedly */
-                                + 9    /* Other arguments (listed below) */
+                                + 11   /* Other arguments (listed below) */
                                 + 2    /* dhostname (maybe) */
                                 + 1    /* NULL */
                                ) * sizeof(char **));
@@ -243,9 +582,11 @@ int start_dhcp_client (struct debconfclient *client, char* dhostname)
             arguments[options_count++] = "-V";
             arguments[options_count++] = "d-i";
             arguments[options_count++] = "-T";
-            arguments[options_count++] = "1";
+            arguments[options_count++] = interval_str;
             arguments[options_count++] = "-t";
             arguments[options_count++] = dhcp_seconds_str;
+            arguments[options_count++] = "-p";
+            arguments[options_count++] = UDHCPC_PIDFILE;
             for (ptr = dhclient_request_options_udhcpc; *ptr; ptr++) {
                 arguments[options_count++] = "-O";
                 arguments[options_count++] = (char *)*ptr;
@@ -268,26 +609,148 @@ int start_dhcp_client (struct debconfclient *client, char* dhostname)
         return 1; /* should NEVER EVER get here */
     }
     else if (dhcp_pid == -1) {
+        unblock_sigchld();
+        free_race_ifaces(race, num_race);
         di_warning("DHCP fork failed; this is unlikely to end well");
         return 1;
     } else {
         /* dhcp_pid contains the child's PID */
         di_warning("Started DHCP client; PID is %i", dhcp_pid);
-        signal(SIGCHLD, &dhcp_client_sigchld);
+        dhcp_exit_fd = dhcp_client_exit_fd(dhcp_pid);
+        free_race_ifaces(race, num_race);
         return 0;
     }
 }
 
 
+/*
+ * Stop the client we started if it is still trying: SIGTERM, and SIGKILL
+ * if it hasn't exited within NETCFG_DHCP_STOP_WAIT.  The wait is on its
+ * exit descriptor, so it takes only as long as the client does.
+ */
+static void stop_dhcp_child(void)
+{
+    struct timespec start, now;
+    long waited = 0;
+
+    if (reap_dhcp_client())
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    kill(dhcp_pid, SIGTERM);
+
+    while (!reap_dhcp_client()) {
+        struct pollfd pfd = { dhcp_exit_fd, POLLIN, 0 };
+
+        if (waited >= NETCFG_DHCP_STOP_WAIT) {
+            di_warning("DHCP client %i ignored SIGTERM; killing it", dhcp_pid);
+            kill(dhcp_pid, SIGKILL);
+            waitpid(dhcp_pid, NULL, 0);
+            dhcp_pid = -1;
+            if (dhcp_exit_fd >= 0)
+                close(dhcp_exit_fd);
+            dhcp_exit_fd = -1;
+            unblock_sigchld();
+            return;
+        }
+
+        /* Without an exit descriptor, look again every 10ms */
+        poll(&pfd, dhcp_exit_fd >= 0 ? 1 : 0,
+             dhcp_exit_fd >= 0 ? NETCFG_DHCP_STOP_WAIT - waited : 10);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waited = (now.tv_sec - start.tv_sec) * 1000 +
+            (now.tv_nsec - start.tv_nsec) / 1000000;
+    }
+}
+
+/*
+ * Stop DHCP: the client we started, then the daemon it left behind to
+ * keep the lease, found through its pid file.  Only pump has no pid file
+ * and still needs killall.sh.  Before any client has been started in
+ * this run, clean up after all of them.
+ */
 static int kill_dhcp_client(void)
 {
-    if (system("killall.sh")) {
+    stop_dhcp_child();
+
+    if (dhcp_client == BUILTIN || dhcp_client == UNKNOWN)
+        dhcp_engine_stop();
+    if (dhcp_client == DHCLIENT || dhcp_client == UNKNOWN)
+        stop_pidfile(DHCLIENT_PIDFILE, NETCFG_DHCP_STOP_WAIT);
+    if (dhcp_client == UDHCPC || dhcp_client == UNKNOWN)
+        stop_pidfile(UDHCPC_PIDFILE, NETCFG_DHCP_STOP_WAIT);
+
+    if ((dhcp_client == PUMP ||
+         (dhcp_client == UNKNOWN && access("/sbin/pump", F_OK) == 0)) &&
+        system("killall.sh")) {
         /* We can't do much about errors anyway, so ignore them. */
     }
+
     return 0;
 }
 
 
+/*
+ * Wait for the DHCP client to exit, for up to dhcp_seconds, moving the
+ * progress bar on once a second.  Both come from one poll() on the
+ * client's exit descriptor and a timerfd, so the exit is seen as soon as
+ * it happens.  Returns 30 if the user cancelled, 0 otherwise.
+ */
+static int wait_dhcp_client (struct debconfclient *client, int dhcp_seconds)
+{
+    int seconds = 0;
+#ifdef __linux__
+    struct itimerspec tick = { { 1, 0 }, { 1, 0 } };
+    struct pollfd pfd[2];
+    int tfd;
+
+    if (dhcp_exit_fd >= 0 &&
+        (tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) >= 0) {
+        int ret = 0;
+
+        timerfd_settime(tfd, 0, &tick, NULL);
+        pfd[0].fd = dhcp_exit_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = tfd;
+        pfd[1].events = POLLIN;
+
+        while (!reap_dhcp_client() && seconds < dhcp_seconds) {
+            uint64_t ticks;
+
+            if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+                break;
+
+            if ((pfd[1].revents & POLLIN) &&
+                read(tfd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+                seconds += ticks;
+                if (debconf_progress_step(client, ticks) == 30) {
+                    ret = 30;
+                    break;
+                }
+            }
+        }
+
+        close(tfd);
+        return ret;
+    }
+#endif
+
+    /* No descriptors to wait on; check on the client every 100ms */
+    while (!reap_dhcp_client() && seconds < dhcp_seconds) {
+        int tenths;
+
+        for (tenths = 0; tenths < 10 && !reap_dhcp_client(); tenths++)
+            poll(NULL, 0, 100);
+        if (tenths < 10)
+            break;
+        seconds++;
+        if (debconf_progress_step(client, 1) == 30)
+            return 30;
+    }
+    return 0;
+}
+
 /*
  * Poll the started DHCP client for netcfg/dhcp_timeout seconds (def. 15)
  * and return 0 if a lease is known to have been acquired,
@@ -301,13 +764,13 @@ static int kill_dhcp_client(void)
  */
 int poll_dhcp_client (struct debconfclient *client)
 {
-    int seconds_slept = 0;
     int ret = 1;
     int dhcp_seconds;
 
     debconf_get(client, "netcfg/dhcp_timeout");
 
-    dhcp_seconds = atoi(client->value);
+    /* The hold-off before the first message doesn't count */
+    dhcp_seconds = atoi(client->value) + (dhcp_delay + 999) / 1000;
 
     /* show progress bar */
     debconf_capb(client, "backup progresscancel");
@@ -318,14 +781,10 @@ int poll_dhcp_client (struct debconfclient *client)
     }
     netcfg_progress_displayed = 1;
 
-    /* wait between 2 and dhcp_seconds seconds for a DHCP lease */
-    while ( ((dhcp_pid > 0) || (seconds_slept < 2))
-            && (seconds_slept < dhcp_seconds) ) {
-        sleep(1);
-        seconds_slept++; /* Not exact but close enough */
-        if (debconf_progress_step(client, 1) == 30)
-            goto stop;
-    }
+    /* wait up to dhcp_seconds seconds for a DHCP lease */
+    if (wait_dhcp_client(client, dhcp_seconds) == 30)
+        goto stop;
+
     /* Either the client exited or time ran out */
 
     /* got a lease? display a success message */
@@ -337,7 +796,6 @@ int poll_dhcp_client (struct debconfclient *client)
             goto stop;
         if (debconf_progress_info(client, "netcfg/dhcp_success_note") == 30)
             goto stop;
-        sleep(2);
     }
 
  stop:
@@ -492,6 +950,8 @@ int netcfg_activate_dhcp (struct debconfclient *client)
                  * child is still running as a daemon
                  */
 
+                take_race_winner();
+
                 /* Before doing anything else, check for a default route */
 
                 if (no_default_route()) {
@@ -511,13 +971,20 @@ int netcfg_activate_dhcp (struct debconfclient *client)
                 char buf[MAXHOSTNAMELEN + 1] = { 0 };
                 char *ptr = NULL;
                 FILE *d = NULL;
+                int have_lease = (read_lease_record() == 0);
 
                 have_domain = 0;
 
                 /*
                  * Default to the domain name returned via DHCP, if any
                  */
-                if ((d = fopen(DOMAIN_FILE, "r")) != NULL) {
+                if (have_lease) {
+                    if (!empty_str(dhcp_lease.domain) && valid_domain(dhcp_lease.domain)) {
+                        debconf_set(client, "netcfg/get_domain", dhcp_lease.domain);
+                        have_domain = 1;
+                    }
+                }
+                else if ((d = fopen(DOMAIN_FILE, "r")) != NULL) {
                     char domain[_UTSNAME_LENGTH + 1] = { 0 };
                     if (fgets(domain, _UTSNAME_LENGTH, d) == NULL) {
                         /* ignore errors; we check for empty strings later */
@@ -535,7 +1002,12 @@ int netcfg_activate_dhcp (struct debconfclient *client)
                  * Record any ntp server information from DHCP for later
                  * verification and use by clock-setup
                  */
-                if ((d = fopen(NTP_SERVER_FILE, "r")) != NULL) {
+                if (have_lease) {
+                    if (!empty_str(dhcp_lease.ntp))
+                        debconf_set(client, "netcfg/dhcp_ntp_servers",
+                                    dhcp_lease.ntp);
+                }
+                else if ((d = fopen(NTP_SERVER_FILE, "r")) != NULL) {
                     char ntpservers[DHCP_OPTION_LEN + 1] = { 0 };
                     if (fgets(ntpservers, DHCP_OPTION_LEN, d) == NULL) {
                         /* ignore errors; we check for empty strings later */
@@ -555,8 +1027,12 @@ int netcfg_activate_dhcp (struct debconfclient *client)
                  * otherwise to the hostname found in DNS for the IP address
                  * of the interface
                  */
-                if (gethostname(buf, sizeof(buf)) == 0
-                    && !empty_str(buf)
+                if (have_lease)
+                    snprintf(buf, sizeof(buf), "%s", dhcp_lease.hostname);
+                else if (gethostname(buf, sizeof(buf)) != 0)
+                    buf[0] = '\0';
+
+                if (!empty_str(buf)
                     && strcmp(buf, "(none)")
                     && valid_domain(buf)
                     ) {
@@ -565,6 +1041,8 @@ int netcfg_activate_dhcp (struct debconfclient *client)
                 }
                 else if (dhostname) {
                     debconf_set(client, "netcfg/get_hostname", dhostname);
+                } else if (have_lease && dhcp_lease.address.s_addr) {
+                    seed_hostname_from_dns(client, &dhcp_lease.address);
                 } else {
                     struct ifreq ifr;
                     struct in_addr d_ipaddr = { 0 };
@@ -589,7 +1067,7 @@ int netcfg_activate_dhcp (struct debconfclient *client)
                 }
 
                 /* Make sure we have NS going if the DHCP server didn't serve it up */
-                if (resolv_conf_entries() <= 0) {
+                if (have_lease ? !dhcp_lease.nameservers : resolv_conf_entries() <= 0) {
                     char *nameservers = NULL;
 
                     if (netcfg_get_nameservers (client, &nameservers) == GO_BACK) {
@@ -624,7 +1102,7 @@ int netcfg_activate_dhcp (struct debconfclient *client)
                 state = HOSTNAME_SANS_NETWORK;
                 break;
             case REPLY_RETRY_AUTOCONFIG:
-                if (dhcp_pid > 0)
+                if (!reap_dhcp_client())
                     state = POLL;
                 else {
                     kill_dhcp_client();
@@ -679,9 +1157,11 @@ int netcfg_activate_dhcp (struct debconfclient *client)
                 /* If the resolv.conf was written by udhcpc, then nameserver_array
                  * will be empty and we'll need to populate it.  If we asked for
                  * the nameservers, then it'll be full, but nobody will care if we
-                 * refill it.
+                 * refill it.  A lease record has all of them, so use that.
                  */
-                if (read_resolv_conf_nameservers(nameserver_array))
+                if (dhcp_lease.nameservers)
+                    netcfg_write_resolv(domain, dhcp_lease.nameservers);
+                else if (read_resolv_conf_nameservers(nameserver_array))
                     netcfg_write_resolv(domain, nameserver_array);
                 else
                     printf("Error reading resolv.conf for nameservers\n");
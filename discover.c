@@ -0,0 +1,409 @@
+/*
+ * Passive network discovery for netcfg-static.
+ *
+ * While the user types in an address, a child process listens on the
+ * interface, without sending anything, to ARP, IPv6 router advertisements
+ * and DHCP replies to other hosts, and keeps what they tell about the
+ * local network in DISCOVER_FILE.  The static configuration questions
+ * take their defaults from it.
+ *
+ * Licensed under the terms of the GNU General Public License
+ */
+
+#include "netcfg.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/param.h>
+#include <sys/wait.h>
+#include <debian-installer.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <netpacket/packet.h>
+#include <linux/filter.h>
+
+/* Give up listening after this many seconds */
+#define DISCOVER_MAX_TIME 900
+
+/* Hosts and IPv6 routers to keep track of */
+#define DISCOVER_MAX_HOSTS 256
+#define DISCOVER_MAX_ROUTERS 4
+
+/* ARP requests to see before guessing a netmask from them */
+#define DISCOVER_MIN_PAIRS 3
+
+/* A host seen in ARP traffic */
+struct seen_host {
+    struct in_addr addr;
+    unsigned char hwaddr[ETH_ALEN];     /* all zeroes until it speaks */
+    int wanted;                         /* ARP requests for it */
+};
+
+struct discover_state {
+    struct netcfg_discovery dhcp;       /* from the last DHCP reply */
+    struct seen_host hosts[DISCOVER_MAX_HOSTS];
+    int num_hosts;
+    unsigned char routers[DISCOVER_MAX_ROUTERS][ETH_ALEN];
+    int num_routers;
+    int prefix;         /* longest prefix common to every ARP request pair */
+    int pairs;
+};
+
+/*
+ * Pass ARP, IPv4 UDP from the DHCP server port and ICMPv6 router
+ * advertisements.  Offsets are from the network header on a SOCK_DGRAM
+ * socket.
+ */
+static int attach_filter(int fd)
+{
+    static struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_ARP, 14, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 8, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 11),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 9),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 7, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 67, 5, 4),
+        /* IPv6: ICMPv6 straight after the header, type 134 */
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 2),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 40),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 134, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xffff),
+    };
+    struct sock_fprog prog = { ARRAY_SIZE(code), code };
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+static int discover_open(const char *iface)
+{
+    struct sockaddr_ll sll;
+    int fd;
+
+    /* No protocol until the filter is in place, so nothing slips past it */
+    fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = if_nametoindex(iface);
+
+    if (!sll.sll_ifindex || attach_filter(fd) < 0 ||
+        bind(fd, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
+        di_warning("discover: cannot listen on %s: %s", iface, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static struct seen_host *find_host(struct discover_state *s, struct in_addr addr)
+{
+    int i;
+
+    for (i = 0; i < s->num_hosts; i++)
+        if (s->hosts[i].addr.s_addr == addr.s_addr)
+            return &s->hosts[i];
+
+    if (s->num_hosts == DISCOVER_MAX_HOSTS)
+        return NULL;
+    memset(&s->hosts[i], 0, sizeof(s->hosts[i]));
+    s->hosts[i].addr = addr;
+    s->num_hosts++;
+    return &s->hosts[i];
+}
+
+/* Link-local and unset addresses say nothing about the subnet */
+static int usable_addr(const unsigned char *a)
+{
+    return a[0] != 0 && !(a[0] == 169 && a[1] == 254);
+}
+
+/*
+ * A host only ARPs for addresses in its own subnet, its gateway's
+ * included, so every request narrows down how long the prefix can be.
+ */
+static void seen_arp(struct discover_state *s, const unsigned char *pkt, size_t len)
+{
+    const struct ether_arp *arp = (const struct ether_arp *) pkt;
+    struct in_addr spa, tpa;
+    struct seen_host *h;
+    uint32_t diff;
+    int common;
+
+    if (len < sizeof(*arp) || ntohs(arp->arp_hrd) != ARPHRD_ETHER ||
+        ntohs(arp->arp_pro) != ETH_P_IP || arp->arp_hln != ETH_ALEN ||
+        arp->arp_pln != 4)
+        return;
+
+    memcpy(&spa, arp->arp_spa, 4);
+    memcpy(&tpa, arp->arp_tpa, 4);
+    if (!usable_addr(arp->arp_spa))
+        return; /* a probe */
+
+    if ((h = find_host(s, spa)))
+        memcpy(h->hwaddr, arp->arp_sha, ETH_ALEN);
+
+    if (ntohs(arp->arp_op) != ARPOP_REQUEST || spa.s_addr == tpa.s_addr ||
+        !usable_addr(arp->arp_tpa))
+        return; /* a reply or an announcement */
+
+    if ((h = find_host(s, tpa)))
+        h->wanted++;
+
+    diff = ntohl(spa.s_addr ^ tpa.s_addr);
+    for (common = 0; common < 32 && !(diff & 0x80000000); common++)
+        diff <<= 1;
+    if (common >= 8 && (s->pairs == 0 || common < s->prefix))
+        s->prefix = common;
+    s->pairs++;
+}
+
+/* The sender of a router advertisement routes IPv6, and likely IPv4 too. */
+static void seen_ra(struct discover_state *s, const unsigned char *hwaddr)
+{
+    int i;
+
+    for (i = 0; i < s->num_routers; i++)
+        if (!memcmp(s->routers[i], hwaddr, ETH_ALEN))
+            return;
+    if (s->num_routers < DISCOVER_MAX_ROUTERS)
+        memcpy(s->routers[s->num_routers++], hwaddr, ETH_ALEN);
+}
+
+/* A DHCPOFFER or DHCPACK to someone else says it all. */
+static void seen_dhcp(struct discover_state *s, const unsigned char *pkt, size_t len)
+{
+    const struct iphdr *ip = (const struct iphdr *) pkt;
+    struct netcfg_discovery d;
+    size_t off = ip->ihl * 4 + sizeof(struct udphdr);
+    const unsigned char *msg = pkt + off, *opt;
+    int type = 0, n;
+
+    /* BOOTREPLY, and the magic cookie at 236 */
+    if (len < sizeof(*ip) || len < off + 240 || msg[0] != 2 ||
+        memcmp(msg + 236, "\x63\x82\x53\x63", 4) != 0)
+        return;
+
+    memset(&d, 0, sizeof(d));
+    for (opt = msg + 240; opt + 2 <= pkt + len && *opt != 255;
+         opt += *opt ? 2 + opt[1] : 1) {
+        if (*opt == 0)
+            continue;
+        if (opt + 2 + opt[1] > pkt + len)
+            break;
+        if (opt[0] == 53 && opt[1] == 1)
+            type = opt[2];
+        else if (opt[0] == 1 && opt[1] == 4)
+            memcpy(&d.netmask, opt + 2, 4);
+        else if (opt[0] == 3 && opt[1] >= 4)
+            memcpy(&d.gateway, opt + 2, 4);
+        else if (opt[0] == 6)
+            for (n = 0; n < opt[1] / 4 && n < 3; n++)
+                memcpy(&d.nameservers[n], opt + 2 + 4 * n, 4);
+    }
+
+    if ((type == 2 || type == 5) && d.netmask.s_addr)
+        s->dhcp = d;
+}
+
+/* Make the best guess we can from what has been seen so far. */
+static void infer(struct discover_state *s, struct netcfg_discovery *d)
+{
+    int i, j, best = -1, best_score = 1;
+
+    /* A few hosts ARPing each other share long prefixes by chance, so
+     * ARP is only trusted to show a network wider than a /24 */
+    *d = s->dhcp;
+    if (!d->netmask.s_addr && s->pairs >= DISCOVER_MIN_PAIRS)
+        d->netmask.s_addr = htonl(~0U << (32 - MIN(s->prefix, 24)));
+
+    if (d->gateway.s_addr)
+        return;
+
+    /* The most wanted host that answers, if it was wanted more than
+     * once; one that also sends router advertisements wins outright */
+    for (i = 0; i < s->num_hosts; i++) {
+        static const unsigned char unknown[ETH_ALEN];
+        int score = s->hosts[i].wanted;
+
+        if (!memcmp(s->hosts[i].hwaddr, unknown, ETH_ALEN))
+            continue;
+
+        for (j = 0; j < s->num_routers; j++)
+            if (!memcmp(s->hosts[i].hwaddr, s->routers[j], ETH_ALEN))
+                score += DISCOVER_MAX_HOSTS * 1000;
+        if (score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    if (best >= 0)
+        d->gateway = s->hosts[best].addr;
+}
+
+static void write_discovery(const struct netcfg_discovery *d)
+{
+    FILE *fp;
+    int i;
+
+    if (!(fp = fopen(DISCOVER_FILE ".new", "w")))
+        return;
+    if (d->netmask.s_addr)
+        fprintf(fp, "netmask=%s\n", inet_ntoa(d->netmask));
+    if (d->gateway.s_addr)
+        fprintf(fp, "gateway=%s\n", inet_ntoa(d->gateway));
+    if (d->nameservers[0].s_addr) {
+        fprintf(fp, "nameservers=");
+        for (i = 0; d->nameservers[i].s_addr; i++)
+            fprintf(fp, "%s%s", i ? " " : "", inet_ntoa(d->nameservers[i]));
+        fprintf(fp, "\n");
+    }
+    if (fclose(fp) != 0 || rename(DISCOVER_FILE ".new", DISCOVER_FILE) < 0)
+        unlink(DISCOVER_FILE ".new");
+}
+
+/* The listener: runs until killed, or for DISCOVER_MAX_TIME at most. */
+static int discover(const char *iface)
+{
+    static struct discover_state s;
+    struct netcfg_discovery last, now;
+    struct pollfd pfd;
+    time_t start = time(NULL);
+    int fd;
+
+    if ((fd = discover_open(iface)) < 0)
+        return 1;
+
+    memset(&last, 0, sizeof(last));
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (time(NULL) - start < DISCOVER_MAX_TIME) {
+        unsigned char pkt[1500];
+        struct sockaddr_ll from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t len;
+
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+        len = recvfrom(fd, pkt, sizeof(pkt), MSG_DONTWAIT,
+                       (struct sockaddr *) &from, &fromlen);
+        if (len <= 0 || from.sll_pkttype == PACKET_OUTGOING)
+            continue;
+
+        switch (ntohs(from.sll_protocol)) {
+        case ETH_P_ARP:
+            seen_arp(&s, pkt, len);
+            break;
+        case ETH_P_IP:
+            seen_dhcp(&s, pkt, len);
+            break;
+        case ETH_P_IPV6:
+            if (from.sll_halen == ETH_ALEN)
+                seen_ra(&s, from.sll_addr);
+            break;
+        }
+
+        infer(&s, &now);
+        if (memcmp(&now, &last, sizeof(now))) {
+            write_discovery(&now);
+            last = now;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Start listening on iface in a child process.  Returns its pid, to be
+ * handed to netcfg_discover_stop(), or -1.
+ */
+pid_t netcfg_discover_start(const char *iface)
+{
+    pid_t pid;
+
+    unlink(DISCOVER_FILE);
+
+    if ((pid = fork()) != 0) {
+        if (pid < 0)
+            di_warning("discover: fork failed: %s", strerror(errno));
+        return pid;
+    }
+
+    /* Don't outlive netcfg */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    _exit(discover(iface));
+}
+
+#else /* !__linux__ */
+
+pid_t netcfg_discover_start(const char *iface)
+{
+    (void) iface;
+    return -1;
+}
+
+#endif /* __linux__ */
+
+void netcfg_discover_stop(pid_t pid)
+{
+    if (pid <= 0)
+        return;
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/* Read the listener's latest findings.  Returns 0 if there are any. */
+int netcfg_discover_read(struct netcfg_discovery *d)
+{
+    char line[256], *value, *tok;
+    FILE *fp;
+    int n;
+
+    memset(d, 0, sizeof(*d));
+    if (!(fp = fopen(DISCOVER_FILE, "r")))
+        return -1;
+
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!(value = strchr(line, '=')))
+            continue;
+        *value++ = '\0';
+
+        if (!strcmp(line, "netmask"))
+            inet_pton(AF_INET, value, &d->netmask);
+        else if (!strcmp(line, "gateway"))
+            inet_pton(AF_INET, value, &d->gateway);
+        else if (!strcmp(line, "nameservers"))
+            for (n = 0, tok = strtok(value, " "); tok && n < 3;
+                 tok = strtok(NULL, " "))
+                if (inet_pton(AF_INET, tok, &d->nameservers[n]) == 1)
+                    n++;
+    }
+    fclose(fp);
+    return 0;
+}
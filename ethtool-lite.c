@@ -1,6 +1,7 @@
 /* The best bits of mii-diag and ethtool mixed into one big jelly roll. */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <net/if.h>
@@ -8,17 +9,16 @@
 #include <sys/ioctl.h>
 #ifndef TEST
 # include <debian-installer/log.h>
-# define CONNECTED 1
-# define DISCONNECTED 2
-# define UNKNOWN 3
 #else
-# define di_info(fmt, ...) printf(fmt, ## __VA_ARGS__)
-# define di_warning(fmt, ...) fprintf(stderr, fmt, ## __VA_ARGS__)
-# define CONNECTED 0
-# define DISCONNECTED 0
-# define UNKNOWN 1
+# include <time.h>
+# define di_info(fmt, ...) printf(fmt "\n", ## __VA_ARGS__)
+# define di_warning(fmt, ...) fprintf(stderr, fmt "\n", ## __VA_ARGS__)
 #endif
 
+#define CONNECTED 1
+#define DISCONNECTED 2
+#define UNKNOWN 3
+
 #if defined(__linux__)
 
 #ifndef ETHTOOL_GLINK
@@ -29,6 +29,9 @@
 # define SIOCETHTOOL 0x8946
 #endif
 
+#define SIOCGMIIPHY_COMPAT 0x8947
+#define SIOCGMIIREG_COMPAT 0x8948
+
 struct ethtool_value
 {
 	u_int32_t cmd;
@@ -41,109 +44,240 @@ struct ethtool_value
 
 #endif
 
-#ifdef TEST
-int main(int argc, char** argv)
-#else
-int ethtool_lite (const char * iface)
-#endif
+/* The ways we know of asking a driver about link, in order of preference. */
+enum probe_method { METHOD_NONE, METHOD_ETHTOOL, METHOD_MII, METHOD_MEDIA, METHOD_MAX };
+
+static const char *const method_names[] = { "none", "ethtool", "MII", "media" };
+
+/*
+ * A link probe keeps its control socket open for the life of the probe and
+ * remembers which method the driver answered to, so that repeated queries
+ * while waiting for link cost a single ioctl each.
+ */
+struct link_probe
 {
-#ifdef TEST
-	char* iface;
-#endif
-	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int fd;
+	char iface[IFNAMSIZ];
+	enum probe_method method;
+	int mii_ctl;          /* ioctl to read an MII register */
+	u_int16_t mii_phy;    /* PHY address reported by the driver */
+	int last;             /* last status, to log only changes */
+};
 
-	if (fd < 0)
+/* Query link using one particular method.  Returns CONNECTED, DISCONNECTED,
+ * or UNKNOWN if the driver doesn't support the method. */
+static int probe_method(struct link_probe *p, enum probe_method method)
+{
+	switch (method) {
+#if defined(__linux__)
+	case METHOD_ETHTOOL:
 	{
-		di_warning("ethtool-lite: could not open control socket\n");
-		return UNKNOWN;
+		struct ethtool_value edata;
+		struct ifreq ifr;
+
+		memset (&edata, 0, sizeof(struct ethtool_value));
+		edata.cmd = ETHTOOL_GLINK;
+		ifr.ifr_data = (char *)&edata;
+		strncpy (ifr.ifr_name, p->iface, IFNAMSIZ);
+
+		if (ioctl (p->fd, SIOCETHTOOL, &ifr) < 0)
+			return UNKNOWN;
+
+		return (edata.data) ? CONNECTED : DISCONNECTED;
 	}
 
-#ifdef TEST
-	if (argc < 2)
+	case METHOD_MII:
 	{
-		fprintf(stderr, "ethtool-lite: Error: must pass an interface name\n");
-		close(fd);
-		return 1;
+		struct ifreq ifr;
+		u_int16_t *data = (u_int16_t *)&ifr.ifr_data;
+
+		strncpy (ifr.ifr_name, p->iface, IFNAMSIZ);
+
+		if (!p->mii_ctl) {
+			/* Find out which MII ioctls this driver speaks. */
+			data[0] = 0;
+			if (ioctl (p->fd, SIOCGMIIPHY_COMPAT, &ifr) >= 0)
+				p->mii_ctl = SIOCGMIIREG_COMPAT;
+			else if (ioctl (p->fd, SIOCDEVPRIVATE, &ifr) >= 0)
+				p->mii_ctl = SIOCDEVPRIVATE + 1;
+			else
+				return UNKNOWN;
+			p->mii_phy = data[0];
+		}
+
+		data[0] = p->mii_phy;
+		data[1] = 1; /* basic mode status register */
+
+		if (ioctl (p->fd, p->mii_ctl, &ifr) < 0)
+			return UNKNOWN;
+
+		return (data[3] & 0x0004) ? CONNECTED : DISCONNECTED;
+	}
+#elif defined(__FreeBSD_kernel__)
+	case METHOD_MEDIA:
+	{
+		struct ifmediareq ifmr;
+
+		memset(&ifmr, 0, sizeof(ifmr));
+		strncpy(ifmr.ifm_name, p->iface, sizeof(ifmr.ifm_name));
+
+		if (ioctl(p->fd, SIOCGIFMEDIA, (caddr_t)&ifmr) < 0)
+			return UNKNOWN;
+
+		if (!(ifmr.ifm_status & IFM_AVALID))
+			return UNKNOWN;
+
+		return (ifmr.ifm_status & IFM_ACTIVE) ? CONNECTED : DISCONNECTED;
 	}
-	iface = argv[1];
 #endif
+	default:
+		return UNKNOWN;
+	}
+}
 
-#if defined(__linux__)
-	struct ethtool_value edata;
-	struct ifreq ifr;
+struct link_probe *link_probe_open (const char *iface)
+{
+	struct link_probe *p = calloc(1, sizeof(*p));
 
-	memset (&edata, 0, sizeof(struct ethtool_value));
-	edata.cmd = ETHTOOL_GLINK;
-	ifr.ifr_data = (char *)&edata;
-	strncpy (ifr.ifr_name, iface, IFNAMSIZ);
+	if (!p)
+		return NULL;
 
-	if (ioctl (fd, SIOCETHTOOL, &ifr) >= 0)
+	p->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (p->fd < 0)
 	{
-		di_info("ethtool-lite: %s is %sconnected.\n", iface,
-		        (edata.data) ? "" : "dis");
-		close(fd);
-		return (edata.data) ? CONNECTED : DISCONNECTED;
+		di_warning("ethtool-lite: could not open control socket");
+		free(p);
+		return NULL;
 	}
-	else
-	{
-		di_info("ethtool-lite: ethtool ioctl on %s failed\n", iface);
-		u_int16_t *data = (u_int16_t *)&ifr.ifr_data;
-		int ctl;
-		data[0] = 0;
-
-		if (ioctl (fd, 0x8947, &ifr) >= 0)
-			ctl = 0x8948;
-		else if (ioctl (fd, SIOCDEVPRIVATE, &ifr) >= 0)
-			ctl = SIOCDEVPRIVATE + 1;
-		else
-		{
-			di_warning("ethtool-lite: couldn't determine MII ioctl to use for %s\n", iface);
-			close(fd);
-			return UNKNOWN;
-		}
 
-		data[1] = 1;
+	strncpy(p->iface, iface, IFNAMSIZ - 1);
+	p->method = METHOD_NONE;
+	p->last = 0;
 
-		if (ioctl (fd, ctl, &ifr) >= 0)
-		{
-			int ret = !(data[3] & 0x0004);
+	return p;
+}
 
-			di_info ("ethtool-lite: %s is %sconnected. (MII)\n", iface,
-				(ret) ? "dis" : "");
+void link_probe_close (struct link_probe *p)
+{
+	if (!p)
+		return;
+	close(p->fd);
+	free(p);
+}
+
+int link_probe_status (struct link_probe *p)
+{
+	int ret = UNKNOWN;
+	enum probe_method m;
 
-			close(fd);
-			return ret ? DISCONNECTED : CONNECTED;
+	if (p->method != METHOD_NONE) {
+		ret = probe_method(p, p->method);
+		if (ret == UNKNOWN) {
+			di_info("ethtool-lite: %s ioctl on %s stopped working",
+			        method_names[p->method], p->iface);
+			p->method = METHOD_NONE;
+			p->mii_ctl = 0;
 		}
 	}
 
-	di_warning("ethtool-lite: MII ioctl failed for %s\n", iface);
+	/* Either the first query, or the remembered method went away */
+	for (m = METHOD_NONE + 1; ret == UNKNOWN && m < METHOD_MAX; m++) {
+		ret = probe_method(p, m);
+		if (ret != UNKNOWN) {
+			di_info("ethtool-lite: using %s ioctl for %s",
+			        method_names[m], p->iface);
+			p->method = m;
+		}
+	}
 
-#elif defined(__FreeBSD_kernel__)
-	struct ifmediareq ifmr;
+	if (ret == UNKNOWN) {
+		if (p->last != UNKNOWN)
+			di_warning("ethtool-lite: couldn't determine link status for %s",
+			           p->iface);
+	} else if (ret != p->last) {
+		di_info("ethtool-lite: %s is %sconnected.", p->iface,
+		        (ret == CONNECTED) ? "" : "dis");
+	}
+
+	p->last = ret;
+	return ret;
+}
 
-	memset(&ifmr, 0, sizeof(ifmr));
-	strncpy(ifmr.ifm_name, iface, sizeof(ifmr.ifm_name));
+#ifndef TEST
+int ethtool_lite (const char * iface)
+{
+	struct link_probe *p = link_probe_open(iface);
+	int ret;
 
-	if (ioctl(fd, SIOCGIFMEDIA, (caddr_t)&ifmr) < 0) {
-		di_warning("ethtool-lite: SIOCGIFMEDIA ioctl on %s failed\n", iface);
-		close(fd);
+	if (!p)
 		return UNKNOWN;
+
+	ret = link_probe_status(p);
+	link_probe_close(p);
+
+	return ret;
+}
+#else
+static double elapsed_us(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e6 + (b->tv_nsec - a->tv_nsec) / 1e3;
+}
+
+/*
+ * ethtool-lite <iface> [count]
+ *
+ * Report link status, then time count queries (default 100) with each
+ * method the driver supports, and with the probe's cached method.
+ * Exits 0 if the status is known, 1 otherwise.
+ */
+int main(int argc, char** argv)
+{
+	struct link_probe *p;
+	struct timespec start, end;
+	enum probe_method m;
+	int count = 100, i, ret;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "ethtool-lite: Error: must pass an interface name\n");
+		return 1;
 	}
+	if (argc > 2 && (count = atoi(argv[2])) <= 0)
+		count = 100;
+
+	if (!(p = link_probe_open(argv[1])))
+		return 1;
 
-	if (ifmr.ifm_status & IFM_AVALID) {
-		if (ifmr.ifm_status & IFM_ACTIVE) {
-			di_info("ethtool-lite: %s is connected.\n", iface);
-			close(fd);
-			return CONNECTED;
-		} else {
-			di_info("ethtool-lite: %s is disconnected.\n", iface);
-			close(fd);
-			return DISCONNECTED;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = link_probe_status(p);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("first query (%s): %.1f us\n", method_names[p->method],
+	       elapsed_us(&start, &end));
+
+	for (m = METHOD_NONE + 1; m < METHOD_MAX; m++) {
+		struct link_probe q = *p;
+
+		q.method = m;
+		q.mii_ctl = 0;
+		if (probe_method(&q, m) == UNKNOWN) {
+			printf("%-8s unsupported\n", method_names[m]);
+			continue;
 		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; i++)
+			probe_method(&q, m);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		printf("%-8s %.2f us/query\n", method_names[m],
+		       elapsed_us(&start, &end) / count);
 	}
 
-	di_warning("ethtool-lite: couldn't determine status for %s\n", iface);
-#endif
-	close(fd);
-	return UNKNOWN;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++)
+		link_probe_status(p);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("cached   %.2f us/query\n", elapsed_us(&start, &end) / count);
+
+	link_probe_close(p);
+	return (ret == UNKNOWN) ? 1 : 0;
 }
+#endif
@@ -1,6 +1,13 @@
 #!/bin/sh
 # Killall for dhcp clients.
 
+# netcfg's own client leaves a daemon behind to renew the lease
+pidfile=/var/run/netcfg-dhcp.pid
+if [ -f $pidfile ]; then
+	kill -TERM $(cat $pidfile) 2>/dev/null || true
+	rm -f $pidfile
+fi
+
 for client in dhclient udhcpc pump; do
 	pid=$(pidof $client) || true
 	[ "$pid" ] || continue
@@ -44,11 +44,15 @@
 #include <debian-installer.h>
 #include <time.h>
 #include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #include <ifaddrs.h>
 
 #ifdef __linux__
 #include <netpacket/packet.h>
+#include <sys/syscall.h>
 #define SYSCLASSNET "/sys/class/net/"
 #endif /* __linux__ */
 
@@ -199,21 +203,144 @@ int check_kill_switch(const char *iface)
 }
 #endif /* __linux__ */
 
+#ifndef __GNU__
+/* Interface table, loaded by netcfg_load_ifaces() */
+static struct netcfg_iface *iface_table = NULL;
+static int iface_table_len = -1;
+
+#if defined(__linux__)
+static int is_wireless_sysfs(const char *iface)
+{
+    char path[sizeof(SYSCLASSNET) + IFNAMSIZ + sizeof("/wireless")];
+    struct stat st;
+
+    snprintf(path, sizeof(path), SYSCLASSNET "%s/wireless", iface);
+    if (stat(path, &st) == 0)
+        return 1;
+    snprintf(path, sizeof(path), SYSCLASSNET "%s/phy80211", iface);
+    return stat(path, &st) == 0;
+}
+#endif
+
+/* Build the table from getifaddrs(), for when netlink isn't available.
+ * getifaddrs returns a row per address, so merge them by name. */
+static int load_ifaces_getifaddrs(struct netcfg_iface **table)
+{
+    struct ifaddrs *ifap, *ifa;
+    struct netcfg_iface *list = NULL, *e;
+    int len = 0, i;
+
+    if (getifaddrs(&ifap) == -1) {
+        di_error("getifaddrs failed: %s", strerror(errno));
+        return -1;
+    }
+
+    for (ifa = ifap; ifa; ifa = ifa->ifa_next) {
+        for (i = 0; i < len; i++)
+            if (!strcmp(list[i].name, ifa->ifa_name))
+                break;
+        if (i == len) {
+            if (!(e = realloc(list, (len + 1) * sizeof(*list))))
+                break;
+            list = e;
+            memset(&list[len], 0, sizeof(*list));
+            strncpy(list[len].name, ifa->ifa_name, IFNAMSIZ - 1);
+            list[len].flags = ifa->ifa_flags;
+            len++;
+        }
+        e = &list[i];
+
+        if (!ifa->ifa_addr)
+            continue;
+#if defined(__FreeBSD_kernel__)
+        if (ifa->ifa_addr->sa_family == AF_LINK) {
+            struct sockaddr_dl *sdl = (struct sockaddr_dl *) ifa->ifa_addr;
+
+            e->index = sdl->sdl_index;
+            e->hwaddr_len = sdl->sdl_alen;
+            if (e->hwaddr_len > (int) sizeof(e->hwaddr))
+                e->hwaddr_len = sizeof(e->hwaddr);
+            memcpy(e->hwaddr, LLADDR(sdl), e->hwaddr_len);
+            if (sdl->sdl_alen == ETH_ALEN)
+                e->type = ARPHRD_ETHER;
+        }
+#elif defined(__linux__)
+        if (ifa->ifa_addr->sa_family == AF_PACKET) {
+            struct sockaddr_ll *sll = (struct sockaddr_ll *) ifa->ifa_addr;
+
+            e->index = sll->sll_ifindex;
+            e->type = sll->sll_hatype;
+            e->hwaddr_len = sll->sll_halen;
+            if (e->hwaddr_len > (int) sizeof(e->hwaddr))
+                e->hwaddr_len = sizeof(e->hwaddr);
+            memcpy(e->hwaddr, sll->sll_addr, e->hwaddr_len);
+        }
+#endif
+    }
+
+    freeifaddrs(ifap);
+    *table = list;
+    return len;
+}
+
+/*
+ * (Re)load the table of network interfaces: name, index, hardware address
+ * and type, flags, and whether it is wireless.  On Linux this is a single
+ * RTM_GETLINK dump.  Returns the number of interfaces, or -1.
+ */
+int netcfg_load_ifaces(void)
+{
+    struct netcfg_iface *table = NULL;
+    int len, i;
+
+    len = netlink_get_links(&table);
+    if (len < 0)
+        len = load_ifaces_getifaddrs(&table);
+    if (len < 0)
+        return -1;
+
+    for (i = 0; i < len; i++) {
+#if defined(__linux__)
+        table[i].wireless = is_wireless_sysfs(table[i].name);
+#else
+        table[i].wireless = 0;
+#endif
+    }
+
+    free(iface_table);
+    iface_table = table;
+    iface_table_len = len;
+
+    return len;
+}
+
+/* Look an interface up in the table, loading it if we haven't yet. */
+const struct netcfg_iface *netcfg_find_iface(const char *name)
+{
+    int i;
+
+    if (iface_table_len < 0 && netcfg_load_ifaces() < 0)
+        return NULL;
+
+    for (i = 0; i < iface_table_len; i++)
+        if (!strcmp(iface_table[i].name, name))
+            return &iface_table[i];
+
+    return NULL;
+}
+#endif /* !__GNU__ */
+
 #if defined(WIRELESS)
 int is_raw_80211(const char *iface)
 {
-    struct ifreq ifr;
-    struct sockaddr sa;
-
-    strncpy(ifr.ifr_name, iface, IFNAMSIZ);
+    const struct netcfg_iface *e = netcfg_find_iface(iface);
 
-    if (skfd && ioctl(skfd, SIOCGIFHWADDR, &ifr) < 0) {
+    if (!e) {
         di_warning("Unable to retrieve interface type.");
         return 0;
     }
 
-    sa = * (struct sockaddr *) &ifr.ifr_hwaddr;
-    switch (sa.sa_family) {
+    switch (e->type) {
     case ARPHRD_IEEE80211:
     case ARPHRD_IEEE80211_PRISM:
     case ARPHRD_IEEE80211_RADIOTAP:
@@ -279,57 +406,45 @@ int get_all_ifs (int all, char*** ptr)
 #else
 int get_all_ifs (int all, char*** ptr)
 {
-    struct ifaddrs *ifap, *ifa;
-    char ibuf[512];
     char** list = NULL;
     size_t len = 0;
+    int i;
 
-    if (getifaddrs(&ifap) == -1)
+    if (netcfg_load_ifaces() <= 0)
         return 0;
 
-    for (ifa = ifap; ifa; ifa = ifa->ifa_next) {
-        strncpy(ibuf, ifa->ifa_name, sizeof(ibuf));
-        if (ifa->ifa_flags & IFF_LOOPBACK)   /* ignore loopback devices */
+    list = malloc(sizeof(char *) * (iface_table_len + 1));
+    if (!list)
+        return 0;
+
+    for (i = 0; i < iface_table_len; i++) {
+        const struct netcfg_iface *e = &iface_table[i];
+
+        if (e->flags & IFF_LOOPBACK)   /* ignore loopback devices */
             continue;
 #if defined(__linux__)
-        if (!strncmp(ibuf, "sit", 3))        /* ignore tunnel devices */
+        if (!strncmp(e->name, "sit", 3))        /* ignore tunnel devices */
             continue;
 #endif
 #if defined(__FreeBSD_kernel__)
-        if (!strncmp(ibuf, "pfsync", 6))     /* ignore pfsync devices */
+        if (!strncmp(e->name, "pfsync", 6))     /* ignore pfsync devices */
             continue;
-        if (!strncmp(ibuf, "pflog", 5))      /* ignore pflog devices */
+        if (!strncmp(e->name, "pflog", 5))      /* ignore pflog devices */
             continue;
-        if (!strncmp(ibuf, "usbus", 5))      /* ignore usbus devices */
+        if (!strncmp(e->name, "usbus", 5))      /* ignore usbus devices */
             continue;
 #endif
 #if defined(WIRELESS)
-        if (is_raw_80211(ibuf))
+        if (is_raw_80211(e->name))
             continue;
 #endif
-        if (all || ifa->ifa_flags & IFF_UP) {
-            int found = 0;
-            size_t i;
-
-            for (i = 0 ; i < len ; i++) {
-                if (!strcmp(ibuf, list[i])) {
-                    found = 1;
-                }
-            }
-            if (!found) {
-                list = realloc(list, sizeof(char*) * (len + 2));
-                list[len] = strdup(ibuf);
-                len++;
-            }
-        }
+        if (all || e->flags & IFF_UP)
+            list[len++] = strdup(e->name);
     }
 
-    /* OK, now sort the list and terminate it if necessary */
-    if (list != NULL) {
-        qsort(list, len, sizeof(char *), qsort_strcmp);
-        list[len] = NULL;
-    }
-    freeifaddrs(ifap);
+    /* OK, now sort the list and terminate it */
+    qsort(list, len, sizeof(char *), qsort_strcmp);
+    list[len] = NULL;
 
     *ptr = list;
 
@@ -337,27 +452,176 @@ int get_all_ifs (int all, char*** ptr)
 }
 #endif
 
+/*
+ * An index of the interface names listed in one of the small files that
+ * hw-detect and friends leave for us, keyed by exact name.  It is read on
+ * first use and again whenever the file changes.
+ */
+#define NAME_INDEX_BUCKETS 64
+
+struct name_entry {
+    char *name;
+    char *value;
+    struct name_entry *next;
+};
+
+struct name_index {
+    const char *path;
+    /* Split a line into name and value (which may be NULL).  Returns 1 to
+     * add it, 0 to skip it and -1 to stop reading. */
+    int (*parse)(char *line, char **name, char **value);
+    int present;                /* did the file exist last time we looked */
+    int loaded;
+    struct stat st;             /* to notice when it changes */
+    struct name_entry *buckets[NAME_INDEX_BUCKETS];
+};
+
+static unsigned int name_hash(const char *name)
+{
+    unsigned int h = 5381;
+
+    while (*name)
+        h = h * 33 + (unsigned char) *name++;
+
+    return h % NAME_INDEX_BUCKETS;
+}
+
+static void name_index_clear(struct name_index *idx)
+{
+    int i;
+
+    for (i = 0; i < NAME_INDEX_BUCKETS; i++) {
+        while (idx->buckets[i]) {
+            struct name_entry *e = idx->buckets[i];
+
+            idx->buckets[i] = e->next;
+            free(e->name);
+            free(e->value);
+            free(e);
+        }
+    }
+    idx->loaded = 0;
+}
+
+/* Make sure the index reflects the file.  Returns whether the file exists. */
+static int name_index_refresh(struct name_index *idx)
+{
+    struct stat st;
+    FILE *f;
+    char buf[512];
+
+    if (stat(idx->path, &st) < 0) {
+        if (idx->loaded)
+            name_index_clear(idx);
+        return idx->present = 0;
+    }
+
+    if (idx->loaded && st.st_mtime == idx->st.st_mtime &&
+        st.st_size == idx->st.st_size && st.st_ino == idx->st.st_ino)
+        return idx->present = 1;
+
+    name_index_clear(idx);
+    idx->st = st;
+    idx->loaded = 1;
+    idx->present = 1;
+
+    if (!(f = fopen(idx->path, "r")))
+        return 1;
+
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        char *name, *value = NULL;
+        struct name_entry *e;
+        int ret;
+        size_t len = strlen(buf);
+
+        if (len && buf[len - 1] == '\n')
+            buf[len - 1] = '\0';
+
+        if ((ret = idx->parse(buf, &name, &value)) < 0)
+            break;
+        if (ret == 0 || empty_str(name))
+            continue;
+
+        if (!(e = malloc(sizeof(*e))))
+            break;
+        e->name = strdup(name);
+        e->value = value ? strdup(value) : NULL;
+        e->next = idx->buckets[name_hash(name)];
+        idx->buckets[name_hash(name)] = e;
+    }
+
+    fclose(f);
+    return 1;
+}
+
+static struct name_entry *name_index_lookup(struct name_index *idx, const char *name)
+{
+    struct name_entry *e;
+
+    if (!name_index_refresh(idx))
+        return NULL;
+
+    for (e = idx->buckets[name_hash(name)]; e; e = e->next)
+        if (!strcmp(e->name, name))
+            return e;
+
+    return NULL;
+}
+
+/* DEVNAMES lines are "iface:description" */
+static int parse_devnames(char *line, char **name, char **value)
+{
+    char *ptr = strchr(line, ':');
+
+    if (!ptr)
+        return -1; /* corrupt */
+
+    *ptr = '\0';
+    *name = line;
+    *value = ptr + 1;
+    return 1;
+}
+
+/* DEVHOTPLUG lists one interface per line */
+static int parse_devhotplug(char *line, char **name, char **value)
+{
+    *name = strtok(line, " \t");
+    *value = NULL;
+    return *name != NULL;
+}
+
+static struct name_index devnames_index = { DEVNAMES, parse_devnames, 0, 0, { 0 }, { 0 } };
+static struct name_index devhotplug_index = { DEVHOTPLUG, parse_devhotplug, 0, 0, { 0 }, { 0 } };
+
 #ifdef __linux__
-short find_in_stab(const char* iface)
+/* STAB is written by cardmgr: "Socket N: ..." headers, then one line per
+ * device of tab-separated socket, class, driver, instance and device name. */
+static int parse_stab(char *line, char **name, char **value)
 {
-    FILE *dn = NULL;
-    char buf[128];
-    size_t len = strlen(iface);
+    char *field = line;
+    int i;
 
-    if (access(STAB, F_OK) == -1)
-        return 0;
+    *value = NULL;
 
-    if (!(dn = popen("grep -v '^Socket' " STAB " | cut -f5", "r")))
+    if (!strncmp(line, "Socket", 6))
         return 0;
 
-    while (fgets (buf, 128, dn) != NULL) {
-        if (!strncmp(buf, iface, len)) {
-            pclose(dn);
-            return 1;
-        }
+    for (i = 1; i < 5; i++) {
+        if (!(field = strchr(field, '\t')))
+            return 0;
+        field++;
     }
-    pclose(dn);
-    return 0;
+
+    field[strcspn(field, "\t")] = '\0';
+    *name = field;
+    return 1;
+}
+
+static struct name_index stab_index = { STAB, parse_stab, 0, 0, { 0 }, { 0 } };
+
+short find_in_stab(const char* iface)
+{
+    return name_index_lookup(&stab_index, iface) != NULL;
 }
 #else /* !__linux__ */
 /* Stub function for platforms not supporting /var/run/stab. */
@@ -369,56 +633,74 @@ short find_in_stab(const char* iface)
 
 char *find_in_devnames(const char* iface)
 {
-    FILE* dn = NULL;
-    char buf[512], *result = NULL;
-    size_t len = strlen(iface);
+    struct name_entry *e = name_index_lookup(&devnames_index, iface);
 
-    if (!(dn = fopen(DEVNAMES, "r")))
-        return NULL;
+    return e ? strdup(e->value) : NULL;
+}
 
-    while (fgets(buf, 512, dn) != NULL) {
-        char *ptr = strchr(buf, ':'), *desc = ptr + 1;
+/* Descriptions of netcfg/internal-* templates, fetched once each */
+struct description {
+    char *template;
+    char *value;        /* NULL if there is none */
+};
+static struct description *descriptions = NULL;
+static int num_descriptions = 0;
 
-        if (!ptr) {
-            result = NULL; /* corrupt */
-            break;
-        }
-        else if (!strncmp(buf, iface, len)) {
-            result = strdup(desc);
-            break;
-        }
-    }
+static const char *get_description(struct debconfclient *client, const char *template)
+{
+    struct description *d;
+    int i;
 
-    fclose(dn);
+    for (i = 0; i < num_descriptions; i++)
+        if (!strcmp(descriptions[i].template, template))
+            return descriptions[i].value;
 
-    if (result) {
-        len = strlen(result);
+    if (!(d = realloc(descriptions, (num_descriptions + 1) * sizeof(*descriptions))))
+        return NULL;
+    descriptions = d;
+    d = &descriptions[num_descriptions++];
 
-        if (result[len - 1] == '\n')
-            result[len - 1] = '\0';
-    }
+    d->template = strdup(template);
+    if (debconf_metaget(client, template, "description") == 0 &&
+        client->value != NULL)
+        d->value = strdup(client->value);
+    else
+        d->value = NULL;
 
-    return result;
+    return d->value;
+}
+
+static int iface_is_wireless(const char *iface)
+{
+#ifndef __GNU__
+    const struct netcfg_iface *e = netcfg_find_iface(iface);
+
+    if (e)
+        return e->wireless;
+#endif
+    return is_wireless_iface(iface);
 }
 
 char *get_ifdsc(struct debconfclient *client, const char *ifp)
 {
     char template[256], *ptr = NULL;
+    const char *desc;
+    int wireless = iface_is_wireless(ifp);
 
     if ((ptr = find_in_devnames(ifp)) != NULL) {
-        debconf_metaget(client, "netcfg/internal-wireless", "description");
+        desc = get_description(client, "netcfg/internal-wireless");
 
-        if (is_wireless_iface(ifp)) {
-            size_t len = strlen(ptr) + strlen(client->value) + 4;
+        if (wireless && desc) {
+            size_t len = strlen(ptr) + strlen(desc) + 4;
             ptr = realloc(ptr, len);
 
-            di_snprintfcat(ptr, len, " (%s)", client->value);
+            di_snprintfcat(ptr, len, " (%s)", desc);
         }
         return ptr; /* already strdup'd */
     }
 
     if (strlen(ifp) < 100) {
-        if (!is_wireless_iface(ifp)) {
+        if (!wireless) {
             /* strip away the number from the interface (eth0 -> eth) */
             char *new_ifp = strdup(ifp), *ptr = new_ifp;
             while ((*ptr < '0' || *ptr > '9') && *ptr != '\0')
@@ -428,46 +710,31 @@ char *get_ifdsc(struct debconfclient *client, const char *ifp)
             sprintf(template, "netcfg/internal-%s", new_ifp);
             free(new_ifp);
 
-            if (debconf_metaget(client, template, "description") == 0 &&
-                client->value != NULL) {
-                return strdup(client->value);
-            }
+            if ((desc = get_description(client, template)) != NULL)
+                return strdup(desc);
         } else {
-            strcpy(template, "netcfg/internal-wifi");
-            debconf_metaget(client, template, "description");
-            return strdup(client->value);
+            if ((desc = get_description(client, "netcfg/internal-wifi")) != NULL)
+                return strdup(desc);
         }
     }
-    debconf_metaget(client, "netcfg/internal-unknown-iface", "description");
-    if (client->value != NULL)
-        return strdup(client->value);
+    if ((desc = get_description(client, "netcfg/internal-unknown-iface")) != NULL)
+        return strdup(desc);
     else
         return strdup("Unknown interface");
 }
 
 int iface_is_hotpluggable(const char *iface)
 {
-    FILE* f = NULL;
-    char buf[256];
-    size_t len = strlen(iface);
-
-    if (!(f = fopen(DEVHOTPLUG, "r"))) {
-        di_info("No hotpluggable devices are present in the system.");
+    if (!name_index_lookup(&devhotplug_index, iface)) {
+        if (!devhotplug_index.present)
+            di_info("No hotpluggable devices are present in the system.");
+        else
+            di_info("Hotpluggable devices available, but %s is not one of them", iface);
         return 0;
     }
 
-    while (fgets(buf, 256, f) != NULL) {
-        if (!strncmp(buf, iface, len)) {
-            di_info("Detected %s as a hotpluggable device", iface);
-            fclose(f);
-            return 1;
-        }
-    }
-
-    fclose(f);
-
-    di_info("Hotpluggable devices available, but %s is not one of them", iface);
-    return 0;
+    di_info("Detected %s as a hotpluggable device", iface);
+    return 1;
 }
 
 FILE *file_open(char *path, const char *opentype)
@@ -577,66 +844,38 @@ static char *find_bootif_iface(const char *bootif,
     /* TODO: Use device_get_status(NET_ADDRESS), see pfinet/ethernet.c */
     return NULL;
 #else
-    struct ifaddrs *ifap, *ifa;
     char *ret = NULL;
+    int i;
 
-    /* TODO: this won't work on the Hurd as getifaddrs doesn't return
-     * unconfigured interfaces.  See comment to get_all_ifs.
-     */
-    if (getifaddrs(&ifap) < 0) {
-        di_error("getifaddrs failed: %s", strerror(errno));
+    if (iface_table_len < 0 && netcfg_load_ifaces() < 0)
         return NULL;
-    }
 
-    for (ifa = ifap; ifa; ifa = ifa->ifa_next) {
-#if defined(__FreeBSD_kernel__)
-        struct sockaddr_dl *sdl;
-#else
-        struct sockaddr_ll *sll;
-#endif
+    for (i = 0; i < iface_table_len; i++) {
+        const struct netcfg_iface *e = &iface_table[i];
 
-        if (ifa->ifa_flags & IFF_LOOPBACK)
+        if (e->flags & IFF_LOOPBACK)
             continue;
 #if defined(__linux__)
-        if (!strncmp(ifa->ifa_name, "sit", 3))  /* ignore tunnel devices */
+        if (!strncmp(e->name, "sit", 3))  /* ignore tunnel devices */
             continue;
 #endif
 #if defined(WIRELESS)
-        if (is_raw_80211(ifa->ifa_name))
+        if (is_raw_80211(e->name))
             continue;
 #endif
-#if defined(__FreeBSD_kernel__)
-        if (ifa->ifa_addr->sa_family != AF_LINK)
-            continue;
-        sdl = (struct sockaddr_dl *) ifa->ifa_addr;
-        if (!sdl)                               /* no link-layer address */
+        if ((e->type != ARPHRD_ETHER &&
+             e->type != ARPHRD_IEEE802) ||
+            e->hwaddr_len != ETH_ALEN)         /* not Ethernet */
             continue;
-        if (sdl->sdl_alen != ETH_ALEN)          /* not Ethernet */
+        if (memcmp(bootif_addr, e->hwaddr, ETH_ALEN) != 0)
             continue;
-        if (memcmp(bootif_addr, LLADDR(sdl), ETH_ALEN) != 0)
-            continue;
-#else
-        if (ifa->ifa_addr->sa_family != AF_PACKET)
-            continue;
-        sll = (struct sockaddr_ll *) ifa->ifa_addr;
-        if (!sll)                               /* no link-layer address */
-            continue;
-        if ((sll->sll_hatype != ARPHRD_ETHER &&
-             sll->sll_hatype != ARPHRD_IEEE802) ||
-            sll->sll_halen != ETH_ALEN)         /* not Ethernet */
-            continue;
-        if (memcmp(bootif_addr, sll->sll_addr, ETH_ALEN) != 0)
-            continue;
-#endif
 
         di_info("Found interface %s with link-layer address %s",
-                ifa->ifa_name, bootif);
-        ret = strdup(ifa->ifa_name);
+                e->name, bootif);
+        ret = strdup(e->name);
         break;
     }
 
-    freeifaddrs(ifap);
-
     if (!ret)
         di_error("Could not find any interface with address %s", bootif);
 
@@ -666,7 +905,7 @@ int netcfg_get_interface(struct debconfclient *client, char **interface,
                          int *numif, const char *defif)
 {
     char *inter = NULL, **ifs;
-    size_t len;
+    size_t len, used = 0;
     int ret, i, asked;
     int num_interfaces = 0;
     unsigned char *bootif_addr;
@@ -730,16 +969,17 @@ int netcfg_get_interface(struct debconfclient *client, char **interface,
         defif=ifs[0];
     }
 
+    interfaces_down(ifs, num_interfaces);
+
     for (i = 0; i < num_interfaces; i++) {
         size_t newchars;
         char *temp = NULL;
 
         inter = ifs[i];
 
-        interface_down(inter);
         ifdsc = get_ifdsc(client, inter);
         newchars = strlen(inter) + strlen(ifdsc) + 5; /* ": , " + NUL */
-        if (len < (strlen(ptr) + newchars)) {
+        if (len < (used + newchars)) {
             if (!(ptr = realloc(ptr, len + newchars + 128)))
                 goto error;
             len += newchars + 128;
@@ -753,7 +993,8 @@ int netcfg_get_interface(struct debconfclient *client, char **interface,
             ((strcmp(defif, inter) == 0) || (strcmp(defif, temp) == 0)))
             debconf_set(client, "netcfg/choose_interface", temp);
 
-        di_snprintfcat(ptr, len, "%s, ", temp);
+        /* append in place; ptr + used is always the end of the string */
+        used += snprintf(ptr + used, len - used, "%s, ", temp);
 
         free(temp);
         free(ifdsc);
@@ -775,7 +1016,7 @@ int netcfg_get_interface(struct debconfclient *client, char **interface,
     else if (num_interfaces > 1) {
         *numif = num_interfaces;
         /* remove the trailing ", ", which confuses cdebconf */
-        ptr[strlen(ptr) - 2] = '\0';
+        ptr[used - 2] = '\0';
 
         debconf_subst(client, "netcfg/choose_interface", "ifchoices", ptr);
         free(ptr);
@@ -1072,13 +1313,175 @@ void netcfg_write_common(struct in_addr ipaddress, char *hostname, char *domain)
 }
 
 
+/* Signal pid, through its pidfd if we have one so that a recycled pid
+ * can't be hit by mistake. */
+static int signal_pid(int pidfd, pid_t pid, int sig)
+{
+#if defined(__linux__) && defined(SYS_pidfd_send_signal)
+    if (pidfd >= 0)
+        return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+#else
+    (void) pidfd;
+#endif
+    return kill(pid, sig);
+}
+
+/*
+ * Stop a daemon: SIGTERM, then SIGKILL if it hasn't gone within
+ * timeout_ms.  The wait is a poll() on a pidfd where the kernel has
+ * them, so it ends as soon as the process does; otherwise the process is
+ * checked on every 10ms.  pid must not be a child of ours, since a child
+ * lingers until reaped.  Returns 1 if there was a process to stop.
+ */
+int stop_pid(pid_t pid, int timeout_ms)
+{
+    int fd = -1, waited;
+
+    if (pid <= 0)
+        return 0;
+
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    fd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+
+    if (signal_pid(fd, pid, SIGTERM) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+
+    if (fd >= 0) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+
+        if (poll(&pfd, 1, timeout_ms) == 0) {
+            di_warning("Process %d ignored SIGTERM; killing it", (int) pid);
+            signal_pid(fd, pid, SIGKILL);
+            poll(&pfd, 1, timeout_ms);
+        }
+        close(fd);
+        return 1;
+    }
+
+    for (waited = 0; waited < timeout_ms && kill(pid, 0) == 0; waited += 10)
+        poll(NULL, 0, 10);
+    if (kill(pid, 0) == 0) {
+        di_warning("Process %d ignored SIGTERM; killing it", (int) pid);
+        kill(pid, SIGKILL);
+    }
+    return 1;
+}
+
+/* As stop_pid(), for the process named in pidfile, which is removed. */
+int stop_pidfile(const char *pidfile, int timeout_ms)
+{
+    FILE *fp;
+    int pid = 0;
+
+    if (!(fp = fopen(pidfile, "r")))
+        return 0;
+    if (fscanf(fp, "%d", &pid) != 1)
+        pid = 0;
+    fclose(fp);
+    unlink(pidfile);
+
+    return stop_pid(pid, timeout_ms);
+}
+
+/*
+ * Reap the children in pids, giving them all together timeout_ms to exit
+ * by themselves before the rest are killed.  Entries <= 0 are skipped,
+ * and entries are cleared as they are reaped.  As in stop_pid(), the wait
+ * is on pidfds where the kernel has them, and otherwise the children are
+ * checked on every 10ms.  Returns the number that had to be killed.
+ */
+int reap_children(pid_t *pids, int num, int timeout_ms)
+{
+    struct pollfd *pfds = calloc(num, sizeof(*pfds));
+    struct timespec start;
+    int i, left, polling, killed = 0;
+
+    for (i = 0; pfds && i < num; i++) {
+        pfds[i].fd = -1;
+#if defined(__linux__) && defined(SYS_pidfd_open)
+        if (pids[i] > 0)
+            pfds[i].fd = syscall(SYS_pidfd_open, pids[i], 0);
+#endif
+        pfds[i].events = POLLIN;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        struct timespec now;
+        long wait_ms;
+
+        left = 0;
+        polling = !pfds;
+        for (i = 0; i < num; i++) {
+            if (pids[i] > 0 && waitpid(pids[i], NULL, WNOHANG) != 0)
+                pids[i] = 0;
+            if (pfds && pids[i] <= 0 && pfds[i].fd >= 0) {
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+            }
+            if (pids[i] > 0) {
+                left++;
+                if (pfds && pfds[i].fd < 0)
+                    polling = 1;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        wait_ms = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000 +
+                                (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (!left || wait_ms <= 0)
+            break;
+
+        poll(pfds, pfds ? num : 0, polling && wait_ms > 10 ? 10 : wait_ms);
+    }
+
+    for (i = 0; i < num; i++) {
+        if (pids[i] > 0) {
+            di_warning("Process %d did not exit; killing it", (int) pids[i]);
+            signal_pid(pfds ? pfds[i].fd : -1, pids[i], SIGKILL);
+            waitpid(pids[i], NULL, 0);
+            pids[i] = 0;
+            killed++;
+        }
+        if (pfds && pfds[i].fd >= 0)
+            close(pfds[i].fd);
+    }
+    free(pfds);
+
+    return killed;
+}
+
 void deconfigure_network(void)
 {
-    /* deconfiguring network interfaces */
-    interface_down(LO_IF);
-    interface_down(interface);
+    /* deconfiguring network interfaces; lo is left alone, loop_setup()
+     * only has to check it */
+    if (interface)
+        interface_down(interface);
 }
 
+#if !defined(__FreeBSD_kernel__)
+/* Can we open packet sockets, or is af_packet still to be loaded? */
+static int have_af_packet(void)
+{
+#ifdef AF_PACKET
+    int fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+    if (fd >= 0) {
+        close(fd);
+        return 1;
+    }
+    return errno != EAFNOSUPPORT;
+#else
+    return 0;
+#endif
+}
+#endif
+
 void loop_setup(void)
 {
     static int afpacket_notloaded = 1;
@@ -1091,11 +1494,15 @@ void loop_setup(void)
     di_exec_shell_log("ifconfig "LO_IF" 127.0.0.1 netmask 255.0.0.0");
 #else
     if (afpacket_notloaded)
-        afpacket_notloaded = di_exec_shell("modprobe af_packet"); /* should become 0 */
-
-    di_exec_shell_log("ip link set "LO_IF" up");
-    di_exec_shell_log("ip addr flush dev "LO_IF);
-    di_exec_shell_log("ip addr add 127.0.0.1/8 dev "LO_IF);
+        afpacket_notloaded = !have_af_packet() &&
+            di_exec_shell("modprobe af_packet"); /* should become 0 */
+
+    /* Nothing to do if lo is up with 127.0.0.1/8 already */
+    if (netlink_setup_loopback(LO_IF) != 0) {
+        di_exec_shell_log("ip link set "LO_IF" up");
+        di_exec_shell_log("ip addr flush dev "LO_IF);
+        di_exec_shell_log("ip addr add 127.0.0.1/8 dev "LO_IF);
+    }
 #endif
 }
 
@@ -1135,7 +1542,7 @@ void seed_hostname_from_dns (struct debconfclient * client, struct in_addr *ipad
     free(host);
 }
 
-void interface_up (char* iface)
+static void set_flags_ioctl (char* iface, int up)
 {
     struct ifreq ifr;
 
@@ -1143,22 +1550,46 @@ void interface_up (char* iface)
 
     if (skfd && ioctl(skfd, SIOCGIFFLAGS, &ifr) >= 0) {
         strncpy(ifr.ifr_name, iface, IFNAMSIZ);
-        ifr.ifr_flags |= (IFF_UP | IFF_RUNNING);
+        if (up)
+            ifr.ifr_flags |= (IFF_UP | IFF_RUNNING);
+        else
+            ifr.ifr_flags &= ~IFF_UP;
         ioctl(skfd, SIOCSIFFLAGS, &ifr);
     }
 }
 
-void interface_down (char* iface)
+/* Change the state of several interfaces in one netlink transaction,
+ * falling back to an ioctl pair per interface where that isn't possible. */
+static void set_links (char** ifaces, int num_ifaces, int up)
 {
-    struct ifreq ifr;
+    int i;
 
-    strncpy(ifr.ifr_name, iface, IFNAMSIZ);
+    if (num_ifaces <= 0)
+        return;
 
-    if (skfd && ioctl(skfd, SIOCGIFFLAGS, &ifr) >= 0) {
-        strncpy(ifr.ifr_name, iface, IFNAMSIZ);
-        ifr.ifr_flags &= ~IFF_UP;
-        ioctl(skfd, SIOCSIFFLAGS, &ifr);
-    }
+    if (netlink_set_links(ifaces, num_ifaces, up) < 0)
+        for (i = 0; i < num_ifaces; i++)
+            set_flags_ioctl(ifaces[i], up);
+}
+
+void interfaces_up (char** ifaces, int num_ifaces)
+{
+    set_links(ifaces, num_ifaces, 1);
+}
+
+void interfaces_down (char** ifaces, int num_ifaces)
+{
+    set_links(ifaces, num_ifaces, 0);
+}
+
+void interface_up (char* iface)
+{
+    interfaces_up(&iface, 1);
+}
+
+void interface_down (char* iface)
+{
+    interfaces_down(&iface, 1);
 }
 
 void parse_args (int argc, char ** argv)
@@ -1256,25 +1687,12 @@ void netcfg_update_entropy (void)
 #endif
 }
 
-/* Attempt to find out whether we've got link on an interface.  Don't try to
- * bring the interface up or down, we leave that to the caller.  Use a
- * progress bar so the user knows what's going on.  Return true if we got
- * link, and false otherwise.
- */
-int netcfg_detect_link(struct debconfclient *client, const char *if_name)
+/* Ask how long to wait for link, in quarter-second ticks. */
+static int get_link_waits(struct debconfclient *client)
 {
-    char arping[256];
-    char s_gateway[INET_ADDRSTRLEN];
-    int count, rv = 0;
     int link_waits = NETCFG_LINK_WAIT_TIME * 4;
-    int gw_tries = NETCFG_GATEWAY_REACHABILITY_TRIES;
     int ret;
 
-    if (gateway.s_addr) {
-        inet_ntop(AF_INET, &gateway, s_gateway, sizeof(s_gateway));
-        sprintf(arping, "arping -c 1 -w 1 -f -I %s %s", if_name, s_gateway);
-    }
-
     /* Ask for link detection timeout. */
     debconf_input(client, "low", "netcfg/link_wait_timeout");
     ret = debconf_go(client);
@@ -1290,33 +1708,189 @@ int netcfg_detect_link(struct debconfclient *client, const char *if_name)
         }
     }
 
+    return link_waits;
+}
+
+/* Once we have link, wait for the gateway (if we know one) to answer ARP
+ * on any of the wired interfaces in ifaces, all probed together.  Progress
+ * is reported in the upper half of the bar.  Returns the index of the
+ * interface the gateway answered on, or -1.
+ */
+static int wait_for_gateway(struct debconfclient *client, char **ifaces, int num_ifaces)
+{
+    char arping[256];
+    char s_gateway[INET_ADDRSTRLEN];
+    char **wired;
+    int *index;
+    int count, i, num_wired = 0, rv = -1;
+    int gw_tries = NETCFG_GATEWAY_REACHABILITY_TRIES;
+    long rtt;
+
+    if (!gateway.s_addr)
+        return -1;
+
+    wired = malloc(num_ifaces * sizeof(*wired));
+    index = malloc(num_ifaces * sizeof(*index));
+    if (!wired || !index)
+        goto out;
+
+    for (i = 0; i < num_ifaces; i++) {
+        if (is_wireless_iface(ifaces[i]))
+            continue;
+        index[num_wired] = i;
+        wired[num_wired++] = ifaces[i];
+    }
+    if (!num_wired)
+        goto out;
+
+    inet_ntop(AF_INET, &gateway, s_gateway, sizeof(s_gateway));
+
+    for (count = 0; count < gw_tries; count++) {
+        i = arp_ping(wired, num_wired, gateway, 1000, &rtt);
+        if (i >= 0) {
+            di_info("gateway %s answered on %s in %ld.%03ld ms", s_gateway,
+                    wired[i], rtt / 1000, rtt % 1000);
+            rv = index[i];
+            break;
+        }
+        if (i == -2) {
+            /* No packet sockets; fall back to arping on the first one */
+            snprintf(arping, sizeof(arping), "arping -c 1 -w 1 -f -I %s %s",
+                     wired[0], s_gateway);
+            if (di_exec_shell_log(arping) == 0) {
+                rv = index[0];
+                break;
+            }
+        }
+        if (debconf_progress_set(client, 50 + 50 * count / gw_tries) == 30)
+            break;
+    }
+
+ out:
+    free(wired);
+    free(index);
+    return rv;
+}
+
+/* Attempt to find out whether we've got link on an interface.  Don't try to
+ * bring the interface up or down, we leave that to the caller.  Use a
+ * progress bar so the user knows what's going on.  Return true if we got
+ * link, and false otherwise.
+ */
+int netcfg_detect_link(struct debconfclient *client, const char *if_name)
+{
+    char *ifaces[] = { (char *) if_name };
+
+    return netcfg_detect_link_any(client, ifaces, 1) == 0;
+}
+
+/* Like netcfg_detect_link, but watch a whole set of interfaces at once
+ * under a single progress bar, so that unplugged ports don't each cost a
+ * full link_wait_timeout.  The caller brings the interfaces up and down.
+ * Return the index in ifaces of the first interface to get link, or -1 if
+ * none of them did.
+ *
+ * Carrier changes are picked up from rtnetlink as soon as the kernel
+ * announces them; ethtool-lite is still asked once a second for drivers
+ * that never send link events, or every tick if netlink is unavailable.
+ */
+int netcfg_detect_link_any(struct debconfclient *client, char **ifaces, int num_ifaces)
+{
+    int count, i, rv = -1;
+    int link_waits;
+    int nlfd;
+    char *names;
+    size_t len = 1;
+    struct link_probe **probes;
+
+    if (num_ifaces <= 0)
+        return -1;
+
+    probes = calloc(num_ifaces, sizeof(*probes));
+    if (!probes)
+        return -1;
+    for (i = 0; i < num_ifaces; i++)
+        probes[i] = link_probe_open(ifaces[i]);
+
+    for (i = 0; i < num_ifaces; i++)
+        len += strlen(ifaces[i]) + 2;
+    names = malloc(len);
+    if (!names)
+        goto out;
+    *names = '\0';
+    for (i = 0; i < num_ifaces; i++)
+        di_snprintfcat(names, len, "%s%s", i ? ", " : "", ifaces[i]);
+
+    link_waits = get_link_waits(client);
+
+    /* Subscribe before the first poll so no transition slips between. */
+    nlfd = netlink_link_monitor();
+
     debconf_capb(client, "progresscancel");
-    debconf_subst(client, "netcfg/link_detect_progress", "interface", if_name);
+    debconf_subst(client, "netcfg/link_detect_progress", "interface", names);
     debconf_progress_start(client, 0, 100, "netcfg/link_detect_progress");
-    for (count = 0; count < link_waits; count++) {
-        usleep(250000);
-        if (debconf_progress_set(client, 50 * count / link_waits) == 30) {
-            /* User cancelled on us... bugger */
-            rv = 0;
-            break;
+    for (count = 0; count < link_waits && rv < 0; count++) {
+        if (nlfd < 0 || count % 4 == 0) {
+            for (i = 0; i < num_ifaces; i++) {
+                if (probes[i] && link_probe_status(probes[i]) == 1) /* ethtool-lite's CONNECTED */ {
+                    rv = i;
+                    break;
+                }
+            }
+            if (rv >= 0)
+                break;
         }
-        if (ethtool_lite(if_name) == 1) /* ethtool-lite's CONNECTED */ {
-            if (gateway.s_addr && !is_wireless_iface(if_name)) {
-                for (count = 0; count < gw_tries; count++) {
-                    if (di_exec_shell_log(arping) == 0)
-                        break;
-                    if (debconf_progress_set(client, 50 + 50 * count / gw_tries) == 30)
-                        break;
+
+        if (nlfd >= 0) {
+            rv = netlink_wait_carrier(nlfd, ifaces, num_ifaces, 250);
+            if (rv == -2) {
+                di_warning("lost netlink link monitor; polling instead");
+                close(nlfd);
+                nlfd = -1;
+                rv = -1;
+            }
+            if (rv >= 0)
+                break;
+        }
+        else
+            usleep(250000);
+
+        if (debconf_progress_set(client, 50 * count / link_waits) == 30)
+            break; /* User cancelled on us... bugger */
+    }
+
+    if (nlfd >= 0)
+        close(nlfd);
+
+    if (rv >= 0 && gateway.s_addr) {
+        /* Prefer whichever linked interface can actually see the gateway */
+        char **linked = malloc(num_ifaces * sizeof(*linked));
+        int *index = malloc(num_ifaces * sizeof(*index));
+        int num_linked = 0;
+
+        if (linked && index) {
+            for (i = 0; i < num_ifaces; i++) {
+                if (i == rv || (probes[i] && link_probe_status(probes[i]) == 1)) {
+                    index[num_linked] = i;
+                    linked[num_linked++] = ifaces[i];
                 }
             }
-            rv = 1;
-            break;
+            i = wait_for_gateway(client, linked, num_linked);
+            if (i >= 0)
+                rv = index[i];
         }
-        debconf_progress_set(client, 100);
+        free(linked);
+        free(index);
     }
 
     debconf_progress_stop(client);
     debconf_capb(client, "");
-    
+    free(names);
+
+ out:
+    for (i = 0; i < num_ifaces; i++)
+        link_probe_close(probes[i]);
+    free(probes);
+
     return rv;
 }
@@ -61,7 +61,7 @@ response_t netcfg_get_method(struct debconfclient *client)
 
 int main(int argc, char *argv[])
 {
-    int num_interfaces = 0;
+    int num_interfaces = 0, num_ifaces;
     enum { BACKUP,
            GET_INTERFACE,
            GET_HOSTNAME_ONLY,
@@ -132,66 +132,54 @@ int main(int argc, char *argv[])
             kill_wpa_supplicant();
 
             /* Choose a default by looking for link */
-            if (get_all_ifs(1, &ifaces) > 1) {
-                while (*ifaces) {
-                    if (check_kill_switch(*ifaces)) {
-                        debconf_subst(client, "netcfg/kill_switch_enabled", "iface", *ifaces);
+            if ((num_ifaces = get_all_ifs(1, &ifaces)) > 1) {
+                char **candidates = malloc(num_ifaces * sizeof(char *));
+                int num_candidates = 0, i;
+
+                if (!candidates) {
+                    state = BACKUP;
+                    break;
+                }
+
+                for (i = 0; i < num_ifaces; i++) {
+                    if (check_kill_switch(ifaces[i])) {
+                        debconf_subst(client, "netcfg/kill_switch_enabled", "iface", ifaces[i]);
                         debconf_input(client, "high", "netcfg/kill_switch_enabled");
                         if (debconf_go(client) == 30) {
                             state = BACKUP;
                             break;
                         }
                         /* Is it still enabled? */
-                        if (check_kill_switch(*ifaces)) {
-                            ifaces++;
+                        if (check_kill_switch(ifaces[i]))
                             continue;
-                        }
                     }
+                    candidates[num_candidates++] = ifaces[i];
+                }
 
-                    interface_up(*ifaces);
-                    if (netcfg_detect_link (client, *ifaces) == 1) /* CONNECTED */ {
-                        di_info("found link on interface %s, making it the default.", *ifaces);
-                        defiface = strdup(*ifaces);
-                        break;
-                    } else {
-#ifdef WIRELESS
-                        struct wireless_config wc;
-#endif /* WIRELESS */
-                        di_info("found no link on interface %s.", *ifaces);
-#ifdef WIRELESS
-                        if (iw_get_basic_config(wfd, *ifaces, &wc) == 0) {
-                            wc.essid[0] = '\0';
-                            wc.essid_on = 0;
-
-                            iw_set_basic_config(wfd, *ifaces, &wc);
-
-                            sleep(1);
-
-                            iw_get_basic_config(wfd, *ifaces, &wc);
-
-                            if (!empty_str(wc.essid)) {
-                                di_info("%s is associated with %s. Selecting as default", *ifaces, wc.essid);
-                                defiface = strdup(*ifaces);
-                                interface_down(*ifaces);
-                                break;
-                            } else {
-                                di_info("%s is not associated. Relegating to defwireless", *ifaces);
-                                if (defwireless != NULL)
-                                    free (defwireless);
-                                defwireless = strdup(*ifaces);
-                            }
-                        }
-                        else
-                            di_info("%s is not a wireless interface. Continuing.", *ifaces);
+                if (state != BACKUP) {
+                    /* Bring everything up at once and watch for the first
+                     * carrier, rather than waiting out the link timeout on
+                     * each empty port in turn. */
+                    interfaces_up(candidates, num_candidates);
 
-                        interface_down(*ifaces);
-#endif
+                    i = netcfg_detect_link_any(client, candidates, num_candidates);
+                    if (i >= 0) {
+                        di_info("found link on interface %s, making it the default.", candidates[i]);
+                        defiface = strdup(candidates[i]);
                     }
+#ifdef WIRELESS
+                    else {
+                        di_info("found no link on any interface.");
+                        i = netcfg_wireless_find_associated(candidates, num_candidates, &defwireless);
+                        if (i >= 0)
+                            defiface = strdup(candidates[i]);
+                    }
+#endif
 
-                    interface_down(*ifaces);
-
-                    ifaces++;
+                    interfaces_down(candidates, num_candidates);
                 }
+
+                free(candidates);
             }
 
             if (state == BACKUP)
@@ -11,6 +11,13 @@
 #define NTP_SERVER_FILE "/tmp/dhcp-ntp-servers"
 #define WPASUPP_CTRL    "/var/run/wpa_supplicant"
 #define WPAPID          "/var/run/wpa_supplicant.pid"
+#define DHCP_ENGINE_PIDFILE "/var/run/netcfg-dhcp.pid"
+#define DHCLIENT_PIDFILE "/var/run/dhclient.pid"
+#define UDHCPC_PIDFILE  "/var/run/udhcpc.pid"
+#define DHCP_RACE_FILE  "/tmp/dhcp-race-winner"
+#define DHCP_LEASE_DIR  "/var/lib/netcfg"
+#define DHCP_LEASE_FILE "/tmp/netcfg-lease"
+#define DISCOVER_FILE   "/tmp/netcfg-discover"
 
 #define DEVNAMES	"/etc/network/devnames"
 #define DEVHOTPLUG	"/etc/network/devhotplug"
@@ -25,6 +32,7 @@
 
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <net/if.h>
 #include <stdio.h>
 #include <cdebconf/debconfclient.h>
 
@@ -51,11 +59,33 @@
  */
 #define NETCFG_LINK_WAIT_TIME 3
 
+/* The most time, in seconds, that wireless interfaces are given to
+ * associate with an access point when looking for a default interface:
+ * a second per card, as when they were tried one at a time, up to this.
+ */
+#define NETCFG_WIRELESS_ASSOC_WAIT 3
+
+/* How long, in milliseconds, a DHCP client is given to exit after
+ * SIGTERM before it is killed.
+ */
+#define NETCFG_DHCP_STOP_WAIT 1000
+
+/* How long, in milliseconds, to wait for a default route to show up
+ * after the DHCP client reports success before asking about it.
+ */
+#define NETCFG_DEFAULT_ROUTE_WAIT 1000
+
 /* The number of times to attempt to verify gateway reachability.
- * Each try invokes arping with a one second timeout.
+ * Each try sends ARP requests for up to one second.
  */
 #define NETCFG_GATEWAY_REACHABILITY_TRIES 50
 
+/* How long, in milliseconds, to spend looking for a free address to
+ * suggest, and how many addresses, at most, to look through.
+ */
+#define NETCFG_SUGGEST_SWEEP_TIME 800
+#define NETCFG_SUGGEST_MAX_ADDRESSES 254
+
 #ifndef MAXHOSTNAMELEN
 #define MAXHOSTNAMELEN 63
 #endif
@@ -87,6 +117,17 @@ extern struct in_addr pointopoint;
 extern char *essid, *wepkey, *passphrase;
 extern wifimode_t mode;
 
+/* An entry in the interface table, filled from a single link dump */
+struct netcfg_iface {
+    char name[IFNAMSIZ];
+    int index;
+    unsigned short type;        /* ARPHRD_* */
+    unsigned int flags;         /* IFF_* */
+    unsigned char hwaddr[32];
+    int hwaddr_len;
+    int wireless;
+};
+
 /* common functions */
 extern int check_kill_switch (const char *iface);
 
@@ -96,6 +137,9 @@ extern void get_name (char *name, char *p);
 
 extern int get_all_ifs (int all, char ***ptr);
 
+extern int netcfg_load_ifaces (void);
+extern const struct netcfg_iface *netcfg_find_iface (const char *name);
+
 extern char *get_ifdsc (struct debconfclient *client, const char *ifp);
 
 extern FILE *file_open (char *path, const char *opentype);
@@ -115,8 +159,34 @@ extern int netcfg_get_domain(struct debconfclient *client,  char **domain);
 
 extern int netcfg_get_static(struct debconfclient *client);
 
+/* What netcfg-static's defaults can be taken from, as seen on the wire */
+struct netcfg_discovery {
+    struct in_addr netmask;
+    struct in_addr gateway;
+    struct in_addr nameservers[4];      /* 0-terminated */
+};
+extern pid_t netcfg_discover_start (const char *iface);
+extern void netcfg_discover_stop (pid_t pid);
+extern int netcfg_discover_read (struct netcfg_discovery *d);
+
 extern int netcfg_activate_dhcp(struct debconfclient *client);
 
+extern int dhcp_engine_usable (const char *iface);
+extern int dhcp_engine_run (const char *iface, const char *hostname, int timeout);
+extern int dhcp_engine_race (char **ifaces, int num_ifaces, const char *hostname, int timeout);
+extern int dhcp_engine_stop (void);
+extern int dhcp_engine_rapid_commit;
+
+/* How DHCP clients space out their messages (netcfg/dhcp_*_interval etc.) */
+struct dhcp_backoff {
+    int initial;        /* first retransmission interval, ms */
+    int max;            /* intervals double up to this, ms */
+    int jitter;         /* each is randomized by up to this percent */
+    int start_delay;    /* hold off up to this long first, ms */
+};
+extern struct dhcp_backoff dhcp_backoff;
+extern int dhcp_start_delay (const unsigned char *hwaddr, int len);
+
 extern int resolv_conf_entries (void);
 
 extern int read_resolv_conf_nameservers (struct in_addr array[]);
@@ -131,6 +201,7 @@ extern void netcfg_write_common (struct in_addr ipaddress, char *hostname,
 void netcfg_nameservers_to_array(char *nameservers, struct in_addr array[]);
 
 extern int is_wireless_iface (const char* iface);
+extern int netcfg_wireless_find_associated (char **ifaces, int num_ifaces, char **defwireless);
 extern int netcfg_wireless_set_essid (struct debconfclient *client, char* iface, char* priority);
 extern int netcfg_wireless_set_wep (struct debconfclient *client, char* iface);
 extern int wireless_security_type (struct debconfclient *client, char* iface);
@@ -142,9 +213,14 @@ extern int wpa_supplicant_start (struct debconfclient *client, char *iface, char
 extern int iface_is_hotpluggable(const char *iface);
 extern short find_in_stab (const char *iface);
 extern void deconfigure_network(void);
+extern int stop_pid (pid_t pid, int timeout_ms);
+extern int stop_pidfile (const char *pidfile, int timeout_ms);
+extern int reap_children (pid_t *pids, int num, int timeout_ms);
 
 extern void interface_up (char*);
 extern void interface_down (char*);
+extern void interfaces_up (char**, int);
+extern void interfaces_down (char**, int);
 
 extern void loop_setup(void);
 extern void seed_hostname_from_dns(struct debconfclient *client, struct in_addr * ipaddress);
@@ -161,6 +237,31 @@ extern void netcfg_update_entropy (void);
 extern int netcfg_write_resolv (char*, struct in_addr *);
 
 extern int ethtool_lite (const char *if_name);
+struct link_probe;
+extern struct link_probe *link_probe_open (const char *if_name);
+extern int link_probe_status (struct link_probe *probe);
+extern void link_probe_close (struct link_probe *probe);
 extern int netcfg_detect_link(struct debconfclient *client, const char *if_name);
+extern int netcfg_detect_link_any(struct debconfclient *client, char **ifaces, int num_ifaces);
+
+extern int arp_ping (char **ifaces, int num_ifaces, struct in_addr target,
+                     int timeout_ms, long *rtt_us);
+extern int arp_probe (const char *iface, struct in_addr addr, int budget_ms,
+                      unsigned char *owner);
+extern int arp_announce (const char *iface, struct in_addr addr);
+extern int arp_sweep (const char *iface, struct in_addr first, int count,
+                      int timeout_ms, unsigned char *taken);
+
+extern int netlink_link_monitor (void);
+extern int netlink_wait_carrier (int fd, char **ifaces, int num_ifaces, int timeout_ms);
+extern int netlink_wait_assoc (int fd, char **ifaces, int num_ifaces, int timeout_ms);
+extern int netlink_get_links (struct netcfg_iface **table);
+extern int netlink_set_links (char **ifaces, int num_ifaces, int up);
+extern int netlink_configure_ipv4 (const char *iface, struct in_addr addr, int prefix,
+                                   struct in_addr broadcast, struct in_addr peer,
+                                   struct in_addr gateway);
+extern int netlink_flush_ipv4 (const char *iface);
+extern int netlink_setup_loopback (const char *lo);
+extern int netlink_has_default_route (int wait_ms);
 
 #endif /* _NETCFG_H_ */
@@ -0,0 +1,1059 @@
+/*
+ * rtnetlink helpers for netcfg.
+ *
+ * Licensed under the terms of the GNU General Public License
+ */
+
+#include "netcfg.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <debian-installer.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#ifndef IFF_LOWER_UP
+#define IFF_LOWER_UP 0x10000
+#endif
+
+#define NETLINK_BUFSIZE 8192
+
+/*
+ * Open a routing netlink socket subscribed to the given multicast groups
+ * (RTMGRP_*).  Returns the socket, or -1 on failure.
+ */
+static int netlink_open(unsigned int groups)
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        di_warning("netlink: could not open socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = groups;
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        di_warning("netlink: could not bind socket: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Open a socket that hears about link state changes. */
+int netlink_link_monitor(void)
+{
+    return netlink_open(RTMGRP_LINK);
+}
+
+/* Milliseconds left until deadline, never negative. */
+static int ms_left(const struct timespec *deadline)
+{
+    struct timespec now;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+        (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+    return ms > 0 ? ms : 0;
+}
+
+static void deadline_in(struct timespec *deadline, int timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Carrier as the kernel sees it: the driver reports the lower layer up. */
+static int link_has_carrier(unsigned int flags)
+{
+    return (flags & IFF_UP) && (flags & (IFF_LOWER_UP | IFF_RUNNING));
+}
+
+static const char *link_name(struct nlmsghdr *nh)
+{
+    struct ifinfomsg *ifi = NLMSG_DATA(nh);
+    struct rtattr *rta = IFLA_RTA(ifi);
+    int len = IFLA_PAYLOAD(nh);
+
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+        if (rta->rta_type == IFLA_IFNAME)
+            return RTA_DATA(rta);
+
+    return NULL;
+}
+
+/* A wireless extensions event (struct iw_event) as packed into IFLA_WIRELESS */
+struct iw_event_hdr {
+    unsigned short len;
+    unsigned short cmd;
+};
+
+#ifndef SIOCGIWAP
+#define SIOCGIWAP 0x8B15
+#endif
+
+/*
+ * Look through the wireless events carried by a link message for a new
+ * access point.  The kernel sends an all-zeroes BSSID on disassociation.
+ */
+static int link_associated(struct nlmsghdr *nh)
+{
+    static const unsigned char none[6] = { 0, 0, 0, 0, 0, 0 };
+    struct ifinfomsg *ifi = NLMSG_DATA(nh);
+    struct rtattr *rta = IFLA_RTA(ifi);
+    int len = IFLA_PAYLOAD(nh);
+
+    if (link_has_carrier(ifi->ifi_flags))
+        return 1;
+
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        unsigned char *ev = RTA_DATA(rta);
+        size_t left = RTA_PAYLOAD(rta);
+
+        if (rta->rta_type != IFLA_WIRELESS)
+            continue;
+
+        while (left >= sizeof(struct iw_event_hdr)) {
+            struct iw_event_hdr hdr;
+
+            memcpy(&hdr, ev, sizeof(hdr));
+            if (hdr.len < sizeof(hdr) || hdr.len > left)
+                break;
+            if (hdr.cmd == SIOCGIWAP &&
+                hdr.len >= sizeof(hdr) + sizeof(struct sockaddr)) {
+                struct sockaddr ap;
+
+                memcpy(&ap, ev + sizeof(hdr), sizeof(ap));
+                if (memcmp(ap.sa_data, none, sizeof(none)) != 0)
+                    return 1;
+            }
+            ev += hdr.len;
+            left -= hdr.len;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Wait up to timeout_ms for a link message about one of ifaces that
+ * satisfies match.  Returns the index in ifaces, -1 on timeout and -2 if
+ * the socket failed.
+ */
+static int wait_link_event(int fd, char **ifaces, int num_ifaces, int timeout_ms,
+                           int (*match)(struct nlmsghdr *nh), const char *what)
+{
+    char buf[NETLINK_BUFSIZE];
+    struct pollfd pfd;
+    struct nlmsghdr *nh;
+    struct timespec deadline;
+    ssize_t len;
+    int i;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    deadline_in(&deadline, timeout_ms);
+
+    for (;;) {
+        int ret = poll(&pfd, 1, ms_left(&deadline));
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -2;
+        if (ret == 0)
+            return -1;
+
+        len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            if (errno == ENOBUFS) /* overran; the caller's poll catches up */
+                return -1;
+            return -2;
+        }
+
+        for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, (size_t) len);
+             nh = NLMSG_NEXT(nh, len)) {
+            const char *name;
+
+            if (nh->nlmsg_type != RTM_NEWLINK)
+                continue;
+            if (!match(nh))
+                continue;
+            if (!(name = link_name(nh)))
+                continue;
+
+            for (i = 0; i < num_ifaces; i++) {
+                if (strcmp(name, ifaces[i]) == 0) {
+                    di_info("netlink: %s on %s", what, name);
+                    return i;
+                }
+            }
+        }
+    }
+}
+
+static int link_carrier(struct nlmsghdr *nh)
+{
+    struct ifinfomsg *ifi = NLMSG_DATA(nh);
+
+    return link_has_carrier(ifi->ifi_flags);
+}
+
+/*
+ * Wait up to timeout_ms for the kernel to report carrier on one of ifaces
+ * over a socket from netlink_link_monitor().  Returns the index in
+ * ifaces of the interface that got carrier, -1 on timeout and -2 if the
+ * socket failed.
+ */
+int netlink_wait_carrier(int fd, char **ifaces, int num_ifaces, int timeout_ms)
+{
+    return wait_link_event(fd, ifaces, num_ifaces, timeout_ms,
+                           link_carrier, "carrier");
+}
+
+/*
+ * As netlink_wait_carrier(), but for wireless interfaces: also accept a
+ * wireless event announcing a new access point, which drivers without
+ * carrier reporting still send on association.
+ */
+int netlink_wait_assoc(int fd, char **ifaces, int num_ifaces, int timeout_ms)
+{
+    return wait_link_event(fd, ifaces, num_ifaces, timeout_ms,
+                           link_associated, "association");
+}
+
+/*
+ * Send a dump request of the given type and feed every reply message to
+ * cb.  Returns 0 once the dump is complete, -1 on error.
+ */
+static int netlink_dump(int type, int family,
+                        int (*cb)(struct nlmsghdr *nh, void *arg), void *arg)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct rtgenmsg g;
+    } req;
+    char buf[NETLINK_BUFSIZE];
+    struct nlmsghdr *nh;
+    ssize_t len;
+    int fd, ret = -1;
+
+    if ((fd = netlink_open(0)) < 0)
+        return -1;
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.g));
+    req.nh.nlmsg_type = type;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nh.nlmsg_seq = 1;
+    req.g.rtgen_family = family;
+
+    if (send(fd, &req, req.nh.nlmsg_len, 0) < 0)
+        goto out;
+
+    for (;;) {
+        len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            goto out;
+        }
+
+        for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, (size_t) len);
+             nh = NLMSG_NEXT(nh, len)) {
+            if (nh->nlmsg_type == NLMSG_DONE) {
+                ret = 0;
+                goto out;
+            }
+            if (nh->nlmsg_type == NLMSG_ERROR)
+                goto out;
+            if (cb(nh, arg) < 0)
+                goto out;
+        }
+    }
+
+ out:
+    if (ret < 0)
+        di_warning("netlink: dump %d failed: %s", type, strerror(errno));
+    close(fd);
+    return ret;
+}
+
+struct link_table {
+    struct netcfg_iface *ifs;
+    int len;
+};
+
+static int add_link(struct nlmsghdr *nh, void *arg)
+{
+    struct link_table *t = arg;
+    struct ifinfomsg *ifi = NLMSG_DATA(nh);
+    struct rtattr *rta = IFLA_RTA(ifi);
+    int len = IFLA_PAYLOAD(nh);
+    struct netcfg_iface *e;
+
+    if (nh->nlmsg_type != RTM_NEWLINK)
+        return 0;
+
+    e = realloc(t->ifs, (t->len + 1) * sizeof(*t->ifs));
+    if (!e)
+        return -1;
+    t->ifs = e;
+    e = &t->ifs[t->len];
+    memset(e, 0, sizeof(*e));
+
+    e->index = ifi->ifi_index;
+    e->type = ifi->ifi_type;
+    e->flags = ifi->ifi_flags;
+
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFLA_IFNAME) {
+            strncpy(e->name, RTA_DATA(rta), IFNAMSIZ - 1);
+        } else if (rta->rta_type == IFLA_ADDRESS) {
+            e->hwaddr_len = RTA_PAYLOAD(rta);
+            if (e->hwaddr_len > (int) sizeof(e->hwaddr))
+                e->hwaddr_len = sizeof(e->hwaddr);
+            memcpy(e->hwaddr, RTA_DATA(rta), e->hwaddr_len);
+        }
+    }
+
+    if (e->name[0])
+        t->len++;
+    return 0;
+}
+
+/*
+ * Fill *table with every link the kernel knows about, in one RTM_GETLINK
+ * dump.  The wireless flag is left for the caller.  Returns the number of
+ * entries, or -1 on failure.
+ */
+int netlink_get_links(struct netcfg_iface **table)
+{
+    struct link_table t = { NULL, 0 };
+
+    if (netlink_dump(RTM_GETLINK, AF_UNSPEC, add_link, &t) < 0) {
+        free(t.ifs);
+        return -1;
+    }
+
+    *table = t.ifs;
+    return t.len;
+}
+
+/*
+ * A batch of requests built up in one buffer and sent with a single
+ * sendmsg(); every message asks for an ack and carries its own sequence
+ * number so the replies can be matched up.
+ */
+struct nl_batch {
+    char *buf;
+    size_t len, size;
+    int count;
+};
+
+/* Space reserved after each message for nl_batch_attr() */
+#define NL_ATTR_ROOM 64
+
+static struct nlmsghdr *nl_batch_add(struct nl_batch *b, int type, int flags,
+                                     const void *body, size_t body_len)
+{
+    size_t need = NLMSG_SPACE(body_len) + NL_ATTR_ROOM;
+    struct nlmsghdr *nh;
+
+    if (b->len + need > b->size) {
+        char *p = realloc(b->buf, b->size + need + 1024);
+
+        if (!p)
+            return NULL;
+        b->buf = p;
+        b->size += need + 1024;
+    }
+
+    nh = (struct nlmsghdr *) (b->buf + b->len);
+    memset(nh, 0, need);
+    nh->nlmsg_len = NLMSG_LENGTH(body_len);
+    nh->nlmsg_type = type;
+    nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nh->nlmsg_seq = ++b->count;
+    memcpy(NLMSG_DATA(nh), body, body_len);
+
+    b->len += NLMSG_ALIGN(nh->nlmsg_len);
+    return nh;
+}
+
+/* Append an attribute to the message just added to the batch. */
+static void nl_batch_attr(struct nl_batch *b, struct nlmsghdr *nh, int type,
+                          const void *data, size_t data_len)
+{
+    struct rtattr *rta = (struct rtattr *) ((char *) nh + NLMSG_ALIGN(nh->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(data_len);
+    memcpy(RTA_DATA(rta), data, data_len);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+    b->len = (char *) nh - b->buf + NLMSG_ALIGN(nh->nlmsg_len);
+}
+
+static void nl_batch_free(struct nl_batch *b)
+{
+    free(b->buf);
+    memset(b, 0, sizeof(*b));
+}
+
+/*
+ * Send the batch and wait for all its acks.  status[i] is set to 0 or a
+ * negative errno for the i-th message.  Returns 0 if every message was
+ * acknowledged, -1 if the exchange itself failed.
+ */
+static int nl_batch_send(struct nl_batch *b, int *status)
+{
+    char buf[NETLINK_BUFSIZE];
+    struct sockaddr_nl kernel;
+    struct nlmsghdr *nh;
+    struct pollfd pfd;
+    ssize_t len;
+    int fd, i, acked = 0, ret = -1;
+
+    if (b->count == 0)
+        return 0;
+
+    if ((fd = netlink_open(0)) < 0)
+        return -1;
+
+    for (i = 0; i < b->count; i++)
+        status[i] = -ETIMEDOUT;
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    if (sendto(fd, b->buf, b->len, 0, (struct sockaddr *) &kernel,
+               sizeof(kernel)) < 0) {
+        di_warning("netlink: send failed: %s", strerror(errno));
+        goto out;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (acked < b->count) {
+        if (poll(&pfd, 1, 1000) <= 0) {
+            di_warning("netlink: timed out waiting for acks");
+            goto out;
+        }
+        len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            goto out;
+        }
+
+        for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, (size_t) len);
+             nh = NLMSG_NEXT(nh, len)) {
+            struct nlmsgerr *err = NLMSG_DATA(nh);
+
+            if (nh->nlmsg_type != NLMSG_ERROR)
+                continue;
+            if (nh->nlmsg_seq < 1 || nh->nlmsg_seq > (unsigned int) b->count)
+                continue;
+            status[nh->nlmsg_seq - 1] = err->error;
+            acked++;
+        }
+    }
+    ret = 0;
+
+ out:
+    close(fd);
+    return ret;
+}
+
+/*
+ * Bring the named interfaces up (or down) in a single netlink transaction,
+ * skipping any that are already in that state.  Returns the number of
+ * interfaces that could not be changed, or -1 if netlink is unusable.
+ */
+int netlink_set_links(char **ifaces, int num_ifaces, int up)
+{
+    struct netcfg_iface *table = NULL;
+    struct nl_batch b = { NULL, 0, 0, 0 };
+    const char **names = NULL;
+    int *status = NULL;
+    int len, i, j, failed = 0;
+
+    if ((len = netlink_get_links(&table)) < 0)
+        return -1;
+
+    names = malloc(num_ifaces * sizeof(*names));
+    status = malloc(num_ifaces * sizeof(*status));
+    if (!names || !status) {
+        failed = -1;
+        goto out;
+    }
+
+    for (i = 0; i < num_ifaces; i++) {
+        struct ifinfomsg ifi;
+
+        for (j = 0; j < len; j++)
+            if (!strcmp(table[j].name, ifaces[i]))
+                break;
+        if (j == len) {
+            di_warning("netlink: no such interface %s", ifaces[i]);
+            failed++;
+            continue;
+        }
+        if (!(table[j].flags & IFF_UP) == !up)
+            continue; /* already there */
+
+        memset(&ifi, 0, sizeof(ifi));
+        ifi.ifi_family = AF_UNSPEC;
+        ifi.ifi_index = table[j].index;
+        ifi.ifi_flags = up ? IFF_UP : 0;
+        ifi.ifi_change = IFF_UP;
+
+        if (!nl_batch_add(&b, RTM_NEWLINK, 0, &ifi, sizeof(ifi))) {
+            failed = -1;
+            goto out;
+        }
+        names[b.count - 1] = ifaces[i];
+    }
+
+    if (nl_batch_send(&b, status) < 0) {
+        failed = -1;
+        goto out;
+    }
+
+    for (i = 0; i < b.count; i++) {
+        if (status[i]) {
+            di_warning("netlink: could not bring %s %s: %s", names[i],
+                       up ? "up" : "down", strerror(-status[i]));
+            failed++;
+        }
+    }
+
+ out:
+    nl_batch_free(&b);
+    free(table);
+    free(names);
+    free(status);
+    return failed;
+}
+
+/*
+ * The IPv4 addresses and routes on one interface, kept as the messages the
+ * kernel dumped them in, so that they can be sent back to delete or
+ * restore them the way "ip addr save"/"ip addr restore" do.
+ */
+struct ipv4_config {
+    int ifindex;
+    struct nl_batch addrs;
+    struct nl_batch routes;
+};
+
+static int keep_msg(struct nl_batch *b, struct nlmsghdr *nh)
+{
+    return nl_batch_add(b, nh->nlmsg_type, 0, NLMSG_DATA(nh),
+                        NLMSG_PAYLOAD(nh, 0)) ? 0 : -1;
+}
+
+static int save_addr(struct nlmsghdr *nh, void *arg)
+{
+    struct ipv4_config *c = arg;
+    struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+
+    if (nh->nlmsg_type != RTM_NEWADDR || ifa->ifa_family != AF_INET ||
+        (int) ifa->ifa_index != c->ifindex)
+        return 0;
+
+    return keep_msg(&c->addrs, nh);
+}
+
+/* Routes in the main table out of c->ifindex, except those the kernel
+ * adds by itself along with an address. */
+static int save_route(struct nlmsghdr *nh, void *arg)
+{
+    struct ipv4_config *c = arg;
+    struct rtmsg *rtm = NLMSG_DATA(nh);
+    struct rtattr *rta = RTM_RTA(rtm);
+    int len = RTM_PAYLOAD(nh), oif = 0;
+    unsigned int table = rtm->rtm_table;
+
+    if (nh->nlmsg_type != RTM_NEWROUTE || rtm->rtm_family != AF_INET ||
+        rtm->rtm_protocol == RTPROT_KERNEL)
+        return 0;
+
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == RTA_TABLE)
+            memcpy(&table, RTA_DATA(rta), sizeof(table));
+        else if (rta->rta_type == RTA_OIF)
+            memcpy(&oif, RTA_DATA(rta), sizeof(oif));
+    }
+    if (table != RT_TABLE_MAIN || oif != c->ifindex)
+        return 0;
+
+    return keep_msg(&c->routes, nh);
+}
+
+/* Read what iface has now: its addresses, and its routes if asked to. */
+static int save_ipv4(struct ipv4_config *c, int ifindex, int routes)
+{
+    memset(c, 0, sizeof(*c));
+    c->ifindex = ifindex;
+
+    if (netlink_dump(RTM_GETADDR, AF_INET, save_addr, c) < 0 ||
+        (routes && netlink_dump(RTM_GETROUTE, AF_INET, save_route, c) < 0))
+        return -1;
+    return 0;
+}
+
+static void free_ipv4(struct ipv4_config *c)
+{
+    nl_batch_free(&c->addrs);
+    nl_batch_free(&c->routes);
+}
+
+/* Queue every message in saved again, as type. */
+static int queue_saved(struct nl_batch *b, struct nl_batch *saved, int type,
+                       int flags)
+{
+    struct nlmsghdr *nh;
+    int len = saved->len;
+
+    for (nh = (struct nlmsghdr *) saved->buf; saved->buf && NLMSG_OK(nh, len);
+         nh = NLMSG_NEXT(nh, len))
+        if (!nl_batch_add(b, type, flags, NLMSG_DATA(nh), NLMSG_PAYLOAD(nh, 0)))
+            return -1;
+    return 0;
+}
+
+/* Queue deletion of everything in c. */
+static int queue_flush(struct nl_batch *b, struct ipv4_config *c)
+{
+    if (queue_saved(b, &c->addrs, RTM_DELADDR, 0) < 0 ||
+        queue_saved(b, &c->routes, RTM_DELROUTE, 0) < 0)
+        return -1;
+    return 0;
+}
+
+static int ifindex_of(const char *iface)
+{
+    unsigned int index = if_nametoindex(iface);
+
+    if (!index)
+        di_warning("netlink: no such interface %s", iface);
+    return index ? (int) index : -1;
+}
+
+/* Send b, and count the requests the kernel refused, not counting
+ * deletions of what was already gone or additions of what was there. */
+static int batch_failures(struct nl_batch *b, const char *iface)
+{
+    int *status = NULL;
+    int i, failed = 0;
+
+    if (b->count == 0)
+        return 0;
+    if (!(status = malloc(b->count * sizeof(*status))) ||
+        nl_batch_send(b, status) < 0) {
+        free(status);
+        return -1;
+    }
+
+    for (i = 0; i < b->count; i++) {
+        if (!status[i] || status[i] == -EADDRNOTAVAIL || status[i] == -ESRCH ||
+            status[i] == -EEXIST)
+            continue;
+        di_warning("netlink: request %d on %s failed: %s", i + 1, iface,
+                   strerror(-status[i]));
+        failed++;
+    }
+
+    free(status);
+    return failed;
+}
+
+/*
+ * Put iface back the way old had it: take off whatever it has now and
+ * add old's addresses, then its routes.
+ */
+static void restore_ipv4(const char *iface, struct ipv4_config *old)
+{
+    struct nl_batch b = { NULL, 0, 0, 0 };
+    struct ipv4_config now;
+
+    di_warning("netlink: rolling back configuration of %s", iface);
+
+    if (save_ipv4(&now, old->ifindex, 1) < 0 ||
+        queue_flush(&b, &now) < 0 ||
+        queue_saved(&b, &old->addrs, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE) < 0 ||
+        queue_saved(&b, &old->routes, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL) < 0 ||
+        batch_failures(&b, iface) != 0)
+        di_error("netlink: could not roll back %s", iface);
+
+    nl_batch_free(&b);
+    free_ipv4(&now);
+}
+
+/*
+ * Replace the IPv4 configuration of iface in one transaction: drop any
+ * addresses and routes it has, add addr/prefix with the given broadcast
+ * or point-to-point peer (either may be 0), and make gateway, or if
+ * there's a peer the link itself, the default route.  Every step is
+ * acknowledged; if any fails, the old configuration is put back.
+ * Returns 0 on success, -1 if netlink could not be used at all, or the
+ * number of requests the kernel refused.
+ */
+int netlink_configure_ipv4(const char *iface, struct in_addr addr, int prefix,
+                           struct in_addr broadcast, struct in_addr peer,
+                           struct in_addr gateway)
+{
+    struct nl_batch b = { NULL, 0, 0, 0 };
+    struct ipv4_config old;
+    struct nlmsghdr *nh;
+    struct ifaddrmsg ifa;
+    int ifindex, failed = -1;
+
+    if ((ifindex = ifindex_of(iface)) < 0)
+        return -1;
+
+    if (save_ipv4(&old, ifindex, 1) < 0 || queue_flush(&b, &old) < 0)
+        goto out;
+
+    memset(&ifa, 0, sizeof(ifa));
+    ifa.ifa_family = AF_INET;
+    ifa.ifa_prefixlen = prefix;
+    ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+    ifa.ifa_index = ifindex;
+
+    if (!(nh = nl_batch_add(&b, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE,
+                            &ifa, sizeof(ifa))))
+        goto out;
+    nl_batch_attr(&b, nh, IFA_LOCAL, &addr, sizeof(addr));
+    if (peer.s_addr)
+        nl_batch_attr(&b, nh, IFA_ADDRESS, &peer, sizeof(peer));
+    else
+        nl_batch_attr(&b, nh, IFA_ADDRESS, &addr, sizeof(addr));
+    if (broadcast.s_addr)
+        nl_batch_attr(&b, nh, IFA_BROADCAST, &broadcast, sizeof(broadcast));
+
+    if (gateway.s_addr || peer.s_addr) {
+        struct rtmsg rtm;
+        unsigned int mask = prefix ? htonl(~0U << (32 - prefix)) : 0;
+
+        memset(&rtm, 0, sizeof(rtm));
+        rtm.rtm_family = AF_INET;
+        rtm.rtm_table = RT_TABLE_MAIN;
+        rtm.rtm_protocol = RTPROT_BOOT;
+        rtm.rtm_scope = peer.s_addr ? RT_SCOPE_LINK : RT_SCOPE_UNIVERSE;
+        rtm.rtm_type = RTN_UNICAST;
+        /* Some servers hand out a router outside the subnet */
+        if (!peer.s_addr && (gateway.s_addr & mask) != (addr.s_addr & mask))
+            rtm.rtm_flags = RTNH_F_ONLINK;
+
+        if (!(nh = nl_batch_add(&b, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE,
+                                &rtm, sizeof(rtm))))
+            goto out;
+        if (!peer.s_addr)
+            nl_batch_attr(&b, nh, RTA_GATEWAY, &gateway, sizeof(gateway));
+        nl_batch_attr(&b, nh, RTA_OIF, &ifindex, sizeof(ifindex));
+    }
+
+    if ((failed = batch_failures(&b, iface)) != 0)
+        restore_ipv4(iface, &old);
+
+ out:
+    nl_batch_free(&b);
+    free_ipv4(&old);
+    return failed;
+}
+
+/* Remove every IPv4 address from iface.  Returns as for
+ * netlink_configure_ipv4(). */
+int netlink_flush_ipv4(const char *iface)
+{
+    struct nl_batch b = { NULL, 0, 0, 0 };
+    struct ipv4_config c;
+    int ifindex, failed = -1;
+
+    if ((ifindex = ifindex_of(iface)) < 0)
+        return -1;
+
+    if (save_ipv4(&c, ifindex, 0) == 0 &&
+        queue_saved(&b, &c.addrs, RTM_DELADDR, 0) == 0)
+        failed = batch_failures(&b, iface);
+
+    nl_batch_free(&b);
+    free_ipv4(&c);
+    return failed;
+}
+
+/* Is 127.0.0.1/8 among the addresses in c? */
+static int has_loopback_addr(struct ipv4_config *c)
+{
+    struct nlmsghdr *nh;
+    int len = c->addrs.len;
+
+    for (nh = (struct nlmsghdr *) c->addrs.buf; c->addrs.buf && NLMSG_OK(nh, len);
+         nh = NLMSG_NEXT(nh, len)) {
+        struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+        struct rtattr *rta = IFA_RTA(ifa);
+        int alen = IFA_PAYLOAD(nh);
+        struct in_addr local = { 0 };
+
+        for (; RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen))
+            if (rta->rta_type == IFA_LOCAL)
+                memcpy(&local, RTA_DATA(rta), sizeof(local));
+
+        if (ifa->ifa_prefixlen == 8 && local.s_addr == htonl(INADDR_LOOPBACK))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Make sure the loopback interface is up with 127.0.0.1/8, changing only
+ * what isn't so already.  Returns 0 on success, -1 if netlink could not
+ * be used, or the number of requests the kernel refused.
+ */
+int netlink_setup_loopback(const char *lo)
+{
+    struct nl_batch b = { NULL, 0, 0, 0 };
+    struct netcfg_iface *table = NULL;
+    struct ipv4_config c;
+    struct nlmsghdr *nh;
+    int len, i, failed = -1;
+
+    if ((len = netlink_get_links(&table)) < 0)
+        return -1;
+    for (i = 0; i < len; i++)
+        if (!strcmp(table[i].name, lo))
+            break;
+    if (i == len) {
+        di_warning("netlink: no such interface %s", lo);
+        free(table);
+        return -1;
+    }
+
+    if (save_ipv4(&c, table[i].index, 0) < 0)
+        goto out;
+
+    if (!(table[i].flags & IFF_UP)) {
+        struct ifinfomsg ifi;
+
+        memset(&ifi, 0, sizeof(ifi));
+        ifi.ifi_family = AF_UNSPEC;
+        ifi.ifi_index = table[i].index;
+        ifi.ifi_flags = IFF_UP;
+        ifi.ifi_change = IFF_UP;
+        if (!nl_batch_add(&b, RTM_NEWLINK, 0, &ifi, sizeof(ifi)))
+            goto out;
+    }
+
+    if (!has_loopback_addr(&c)) {
+        struct ifaddrmsg ifa;
+        struct in_addr addr;
+
+        addr.s_addr = htonl(INADDR_LOOPBACK);
+        memset(&ifa, 0, sizeof(ifa));
+        ifa.ifa_family = AF_INET;
+        ifa.ifa_prefixlen = 8;
+        ifa.ifa_scope = RT_SCOPE_HOST;
+        ifa.ifa_index = table[i].index;
+
+        if (queue_saved(&b, &c.addrs, RTM_DELADDR, 0) < 0 ||
+            !(nh = nl_batch_add(&b, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE,
+                                &ifa, sizeof(ifa))))
+            goto out;
+        nl_batch_attr(&b, nh, IFA_LOCAL, &addr, sizeof(addr));
+        nl_batch_attr(&b, nh, IFA_ADDRESS, &addr, sizeof(addr));
+    }
+
+    failed = batch_failures(&b, lo);
+
+ out:
+    nl_batch_free(&b);
+    free_ipv4(&c);
+    free(table);
+    return failed;
+}
+
+/* Does nh describe a default route in the main table? */
+static int is_default_route(struct nlmsghdr *nh)
+{
+    struct rtmsg *rtm = NLMSG_DATA(nh);
+    struct rtattr *rta = RTM_RTA(rtm);
+    int len = RTM_PAYLOAD(nh);
+    unsigned int table = rtm->rtm_table;
+
+    if (nh->nlmsg_type != RTM_NEWROUTE || rtm->rtm_family != AF_INET ||
+        rtm->rtm_dst_len != 0 || rtm->rtm_type != RTN_UNICAST)
+        return 0;
+
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+        if (rta->rta_type == RTA_TABLE)
+            memcpy(&table, RTA_DATA(rta), sizeof(table));
+
+    return table == RT_TABLE_MAIN;
+}
+
+static int find_default_route(struct nlmsghdr *nh, void *arg)
+{
+    if (is_default_route(nh))
+        *(int *) arg = 1;
+    return 0;
+}
+
+/*
+ * Is there an IPv4 default route in the main table?  If not, wait up to
+ * wait_ms for one to be added, since DHCP clients may install it just
+ * after they exit.  Returns 1 if there is one, 0 if not, and -1 if the
+ * routing table could not be read.
+ */
+int netlink_has_default_route(int wait_ms)
+{
+    char buf[NETLINK_BUFSIZE];
+    struct pollfd pfd;
+    struct nlmsghdr *nh;
+    struct timespec deadline;
+    ssize_t len;
+    int found = 0;
+
+    /* Subscribe before the dump, so that a route added in between is seen */
+    pfd.fd = wait_ms > 0 ? netlink_open(RTMGRP_IPV4_ROUTE) : -1;
+    pfd.events = POLLIN;
+
+    if (netlink_dump(RTM_GETROUTE, AF_INET, find_default_route, &found) < 0) {
+        if (pfd.fd >= 0)
+            close(pfd.fd);
+        return -1;
+    }
+    if (found || pfd.fd < 0)
+        goto out;
+
+    deadline_in(&deadline, wait_ms);
+    while (!found) {
+        int ret = poll(&pfd, 1, ms_left(&deadline));
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+
+        len = recv(pfd.fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            if (errno == ENOBUFS) {
+                /* Missed some; look at the table again instead */
+                if (netlink_dump(RTM_GETROUTE, AF_INET, find_default_route,
+                                 &found) < 0)
+                    break;
+                continue;
+            }
+            break;
+        }
+
+        for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, (size_t) len);
+             nh = NLMSG_NEXT(nh, len))
+            if (is_default_route(nh))
+                found = 1;
+    }
+
+ out:
+    if (pfd.fd >= 0)
+        close(pfd.fd);
+    return found;
+}
+
+#else /* !__linux__ */
+
+/* Stubs for platforms without rtnetlink; callers fall back to polling. */
+int netlink_link_monitor(void)
+{
+    return -1;
+}
+
+int netlink_wait_carrier(int fd, char **ifaces, int num_ifaces, int timeout_ms)
+{
+    (void) fd;
+    (void) ifaces;
+    (void) num_ifaces;
+    (void) timeout_ms;
+    return -2;
+}
+
+int netlink_wait_assoc(int fd, char **ifaces, int num_ifaces, int timeout_ms)
+{
+    (void) fd;
+    (void) ifaces;
+    (void) num_ifaces;
+    (void) timeout_ms;
+    return -2;
+}
+
+int netlink_get_links(struct netcfg_iface **table)
+{
+    (void) table;
+    return -1;
+}
+
+int netlink_set_links(char **ifaces, int num_ifaces, int up)
+{
+    (void) ifaces;
+    (void) num_ifaces;
+    (void) up;
+    return -1;
+}
+
+int netlink_configure_ipv4(const char *iface, struct in_addr addr, int prefix,
+                           struct in_addr broadcast, struct in_addr peer,
+                           struct in_addr gateway)
+{
+    (void) iface;
+    (void) addr;
+    (void) prefix;
+    (void) broadcast;
+    (void) peer;
+    (void) gateway;
+    return -1;
+}
+
+int netlink_flush_ipv4(const char *iface)
+{
+    (void) iface;
+    return -1;
+}
+
+int netlink_setup_loopback(const char *lo)
+{
+    (void) lo;
+    return -1;
+}
+
+int netlink_has_default_route(int wait_ms)
+{
+    (void) wait_ms;
+    return -1;
+}
+
+#endif /* __linux__ */
@@ -16,12 +16,124 @@ struct in_addr broadcast = { 0 };
 struct in_addr netmask = { 0 };
 struct in_addr pointopoint = { 0 };
 
+/* Set when the address that was entered turned out to be in use */
+static int address_conflict = 0;
+
+/*
+ * Parse netcfg/address_range: either "first-last", or "address/prefix"
+ * for the host addresses in that subnet.  Returns 1 if it parsed.
+ */
+static int parse_address_range(const char *range, struct in_addr *first,
+                               struct in_addr *last)
+{
+    char buf[2 * INET_ADDRSTRLEN], *sep;
+    uint32_t mask;
+    int prefix;
+
+    snprintf(buf, sizeof(buf), "%s", range);
+
+    if ((sep = strchr(buf, '-')) != NULL) {
+        *sep++ = '\0';
+        return inet_pton (AF_INET, buf, first) == 1 &&
+            inet_pton (AF_INET, sep, last) == 1 &&
+            ntohl(first->s_addr) <= ntohl(last->s_addr);
+    }
+
+    if ((sep = strchr(buf, '/')) != NULL) {
+        *sep++ = '\0';
+        prefix = atoi(sep);
+        if (prefix < 1 || prefix > 30 || inet_pton (AF_INET, buf, first) != 1)
+            return 0;
+        mask = ~0U << (32 - prefix);
+        last->s_addr = htonl((ntohl(first->s_addr) | ~mask) - 1);
+        first->s_addr = htonl((ntohl(first->s_addr) & mask) + 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Offer a free address as the default for netcfg/get_ipaddress, if
+ * netcfg/suggest_address allows it and there is somewhere to look: the
+ * preseeded netcfg/address_range, the subnet entered so far, or the one
+ * seen on the network.  The first address there that nobody answers ARP
+ * for, and that isn't the gateway, is taken.
+ */
+static void netcfg_suggest_address(struct debconfclient *client)
+{
+    struct netcfg_discovery seen;
+    struct in_addr first, last, avoid = gateway, addr;
+    char ptr1[INET_ADDRSTRLEN];
+    unsigned char *taken;
+    int i, count;
+
+    debconf_get(client, "netcfg/suggest_address");
+    if (strcmp(client->value, "true") || pointopoint.s_addr)
+        return;
+
+    debconf_get(client, "netcfg/address_range");
+    if (client->value && !empty_str(client->value)) {
+        if (!parse_address_range(client->value, &first, &last)) {
+            di_warning("Ignoring bad netcfg/address_range %s", client->value);
+            return;
+        }
+    }
+    else if (network.s_addr && netmask.s_addr) {
+        first.s_addr = htonl(ntohl(network.s_addr) + 1);
+        last.s_addr = htonl(ntohl(broadcast.s_addr) - 1);
+    }
+    else if (netcfg_discover_read(&seen) == 0 &&
+             seen.netmask.s_addr && seen.gateway.s_addr) {
+        avoid = seen.gateway;
+        first.s_addr = htonl(ntohl(avoid.s_addr & seen.netmask.s_addr) + 1);
+        last.s_addr = htonl(ntohl(avoid.s_addr | ~seen.netmask.s_addr) - 1);
+    }
+    else
+        return;
+
+    if (ntohl(first.s_addr) > ntohl(last.s_addr))
+        return; /* a single host */
+
+    count = ntohl(last.s_addr) - ntohl(first.s_addr) + 1;
+    if (count > NETCFG_SUGGEST_MAX_ADDRESSES || count <= 0)
+        count = NETCFG_SUGGEST_MAX_ADDRESSES;
+
+    if ((taken = malloc(count)) == NULL)
+        return;
+
+    if (arp_sweep(interface, first, count, NETCFG_SUGGEST_SWEEP_TIME, taken) >= 0) {
+        for (i = 0; i < count; i++) {
+            addr.s_addr = htonl(ntohl(first.s_addr) + i);
+            if (!taken[i] && addr.s_addr != avoid.s_addr)
+                break;
+        }
+
+        if (i < count) {
+            inet_ntop (AF_INET, &addr, ptr1, sizeof (ptr1));
+            di_info("Suggesting free address %s", ptr1);
+            debconf_set(client, "netcfg/get_ipaddress", ptr1);
+        }
+        else
+            di_info("No free address found to suggest");
+    }
+
+    free(taken);
+}
+
 int netcfg_get_ipaddress(struct debconfclient *client)
 {
     int ret, ok = 0;
 
     old_ipaddress = ipaddress;
 
+    /* Nothing entered yet, or what was entered is taken: try to find
+     * something that isn't */
+    debconf_get(client, "netcfg/get_ipaddress");
+    if (empty_str(client->value) || address_conflict)
+        netcfg_suggest_address(client);
+    address_conflict = 0;
+
     while (!ok) {
         debconf_input (client, "critical", "netcfg/get_ipaddress");
         ret = debconf_go (client);
@@ -83,6 +195,15 @@ int netcfg_get_netmask(struct debconfclient *client)
     int ret, ok = 0;
     char ptr1[INET_ADDRSTRLEN];
     struct in_addr old_netmask = netmask;
+    struct netcfg_discovery seen;
+
+    /* Unless it has been answered or preseeded, suggest the netmask
+     * seen on the network */
+    debconf_fget(client, "netcfg/get_netmask", "seen");
+    if (strcmp(client->value, "true") && netcfg_discover_read(&seen) == 0 &&
+        seen.netmask.s_addr)
+        debconf_set(client, "netcfg/get_netmask",
+                    inet_ntop (AF_INET, &seen.netmask, ptr1, sizeof (ptr1)));
 
     while (!ok) {
         debconf_input (client, "critical", "netcfg/get_netmask");
@@ -109,9 +230,16 @@ int netcfg_get_netmask(struct debconfclient *client)
         network.s_addr = ipaddress.s_addr & netmask.s_addr;
         broadcast.s_addr = (network.s_addr | ~netmask.s_addr);
 
-        /* Preseed gateway */
-        gateway.s_addr = ipaddress.s_addr & netmask.s_addr;
-        gateway.s_addr |= htonl(1);
+        /* Preseed gateway: the one seen on the network if it's in this
+         * subnet, or else the first address in it */
+        if (netcfg_discover_read(&seen) == 0 && seen.gateway.s_addr &&
+            seen.gateway.s_addr != ipaddress.s_addr &&
+            (seen.gateway.s_addr & netmask.s_addr) == network.s_addr) {
+            gateway = seen.gateway;
+        } else {
+            gateway.s_addr = ipaddress.s_addr & netmask.s_addr;
+            gateway.s_addr |= htonl(1);
+        }
     }
 
     inet_ntop (AF_INET, &gateway, ptr1, sizeof (ptr1));
@@ -272,6 +400,9 @@ int netcfg_activate_static(struct debconfclient *client)
     int rv = 0, masksize;
     char buf[256];
     char ptr1[INET_ADDRSTRLEN];
+#if !defined(__GNU__) && !defined(__FreeBSD_kernel__)
+    int nl;
+#endif
 
 #ifdef __GNU__
     snprintf(buf, sizeof(buf),
@@ -336,41 +467,49 @@ int netcfg_activate_static(struct debconfclient *client)
     loop_setup();
     interface_up(interface);
 
-    /* Flush all previous addresses, routes */
-    snprintf(buf, sizeof(buf), "ip addr flush dev %s", interface);
-    rv |= di_exec_shell_log(buf);
-
-    snprintf(buf, sizeof(buf), "ip route flush dev %s", interface);
-    rv |= di_exec_shell_log(buf);
-
     rv |= !inet_ptom (NULL, &masksize, &netmask);
 
-    /* Add the new IP address, P-t-P peer (if necessary) and netmask */
-    snprintf(buf, sizeof(buf), "ip addr add %s/%d ",
-             inet_ntop (AF_INET, &ipaddress, ptr1, sizeof (ptr1)),
-             masksize);
+    /* Flush all previous addresses and routes and set up the new ones in
+     * one go, undone if any of it fails; use ip(8) if netlink can't be. */
+    nl = netlink_configure_ipv4(interface, ipaddress, masksize, broadcast,
+                                pointopoint, gateway);
+    if (nl >= 0) {
+        rv |= nl;
+    } else {
+        /* Flush all previous addresses, routes */
+        snprintf(buf, sizeof(buf), "ip addr flush dev %s", interface);
+        rv |= di_exec_shell_log(buf);
 
-    /* avoid using a second buffer */
-    di_snprintfcat(buf, sizeof(buf), "broadcast %s dev %s",
-                   inet_ntop (AF_INET, &broadcast, ptr1, sizeof (ptr1)),
-                   interface);
+        snprintf(buf, sizeof(buf), "ip route flush dev %s", interface);
+        rv |= di_exec_shell_log(buf);
 
-    if (pointopoint.s_addr)
-        di_snprintfcat(buf, sizeof(buf), " peer %s",
-                       inet_ntop (AF_INET, &pointopoint, ptr1, sizeof (ptr1)));
+        /* Add the new IP address, P-t-P peer (if necessary) and netmask */
+        snprintf(buf, sizeof(buf), "ip addr add %s/%d ",
+                 inet_ntop (AF_INET, &ipaddress, ptr1, sizeof (ptr1)),
+                 masksize);
 
-    di_info("executing: %s", buf);
-    rv |= di_exec_shell_log(buf);
+        /* avoid using a second buffer */
+        di_snprintfcat(buf, sizeof(buf), "broadcast %s dev %s",
+                       inet_ntop (AF_INET, &broadcast, ptr1, sizeof (ptr1)),
+                       interface);
 
-    if (pointopoint.s_addr)
-    {
-        snprintf(buf, sizeof(buf), "ip route add default dev %s", interface);
-        rv |= di_exec_shell_log(buf);
-    }
-    else if (gateway.s_addr) {
-        snprintf(buf, sizeof(buf), "ip route add default via %s",
-                 inet_ntop (AF_INET, &gateway, ptr1, sizeof (ptr1)));
+        if (pointopoint.s_addr)
+            di_snprintfcat(buf, sizeof(buf), " peer %s",
+                           inet_ntop (AF_INET, &pointopoint, ptr1, sizeof (ptr1)));
+
+        di_info("executing: %s", buf);
         rv |= di_exec_shell_log(buf);
+
+        if (pointopoint.s_addr)
+        {
+            snprintf(buf, sizeof(buf), "ip route add default dev %s", interface);
+            rv |= di_exec_shell_log(buf);
+        }
+        else if (gateway.s_addr) {
+            snprintf(buf, sizeof(buf), "ip route add default via %s",
+                     inet_ntop (AF_INET, &gateway, ptr1, sizeof (ptr1)));
+            rv |= di_exec_shell_log(buf);
+        }
     }
 #endif
 
@@ -387,14 +526,58 @@ int netcfg_activate_static(struct debconfclient *client)
      */
     netcfg_detect_link(client, interface);
 
+    /* Let the neighbours know where the address is now, in case it was
+     * somewhere else before this install */
+    if (!pointopoint.s_addr)
+        arp_announce(interface, ipaddress);
+
     return 0;
 }
 
+/*
+ * Check that nobody on the link already has ipaddress, within
+ * netcfg/address_probe_budget milliseconds (0 to skip), and tell the user
+ * who does if somebody does.  Returns 1 on a conflict, 0 otherwise,
+ * including when the link can't be probed.
+ */
+static int netcfg_probe_address(struct debconfclient *client)
+{
+    unsigned char owner[6];
+    char addr[INET_ADDRSTRLEN], hwaddr[18];
+    int budget;
+
+    debconf_get(client, "netcfg/address_probe_budget");
+    budget = atoi(client->value);
+    if (budget <= 0 || pointopoint.s_addr)
+        return 0;
+
+    interface_up(interface);
+    if (arp_probe(interface, ipaddress, budget, owner) != 1)
+        return 0;
+
+    inet_ntop(AF_INET, &ipaddress, addr, sizeof(addr));
+    snprintf(hwaddr, sizeof(hwaddr), "%02x:%02x:%02x:%02x:%02x:%02x",
+             owner[0], owner[1], owner[2], owner[3], owner[4], owner[5]);
+    di_warning("%s is already in use by %s", addr, hwaddr);
+    address_conflict = 1;
+
+    debconf_subst(client, "netcfg/address_in_use", "ipaddress", addr);
+    debconf_subst(client, "netcfg/address_in_use", "hwaddr", hwaddr);
+
+    debconf_capb(client);
+    debconf_input(client, "critical", "netcfg/address_in_use");
+    debconf_go(client);
+    debconf_capb(client, "backup");
+    return 1;
+}
+
 int netcfg_get_static(struct debconfclient *client)
 {
     char *nameservers = NULL;
     char ptr1[INET_ADDRSTRLEN];
     char *none;
+    struct netcfg_discovery seen;
+    pid_t listener;
 
     enum { BACKUP, GET_HOSTNAME, GET_IPADDRESS, GET_POINTOPOINT, GET_NETMASK,
            GET_GATEWAY, GATEWAY_UNREACHABLE, GET_NAMESERVERS, CONFIRM,
@@ -407,9 +590,14 @@ int netcfg_get_static(struct debconfclient *client)
     debconf_metaget(client,  "netcfg/internal-none", "description");
     none = client->value ? strdup(client->value) : strdup("<none>");
 
+    /* Listen for hints about the network while the questions are asked */
+    interface_up(interface);
+    listener = netcfg_discover_start(interface);
+
     for (;;) {
         switch (state) {
         case BACKUP:
+            netcfg_discover_stop(listener);
             return 10; /* Back to main */
             break;
 
@@ -455,6 +643,19 @@ int netcfg_get_static(struct debconfclient *client)
             debconf_capb(client, "backup");
             break;
         case GET_NAMESERVERS:
+            debconf_get(client, "netcfg/get_nameservers");
+            if (!nameservers && empty_str(client->value) &&
+                netcfg_discover_read(&seen) == 0 && seen.nameservers[0].s_addr) {
+                char buf[3 * INET_ADDRSTRLEN];
+                int i;
+
+                buf[0] = '\0';
+                for (i = 0; seen.nameservers[i].s_addr; i++)
+                    di_snprintfcat(buf, sizeof(buf), "%s%s", i ? " " : "",
+                                   inet_ntop (AF_INET, &seen.nameservers[i],
+                                              ptr1, sizeof (ptr1)));
+                debconf_set(client, "netcfg/get_nameservers", buf);
+            }
             state = (netcfg_get_nameservers (client, &nameservers)) ?
                 GET_GATEWAY : CONFIRM;
             break;
@@ -492,7 +693,7 @@ int netcfg_get_static(struct debconfclient *client)
             debconf_input(client, "medium", "netcfg/confirm_static");
             debconf_go(client);
             debconf_get(client, "netcfg/confirm_static");
-            if (strstr(client->value, "true")) {
+            if (strstr(client->value, "true") && !netcfg_probe_address(client)) {
                 state = GET_HOSTNAME;
                 netcfg_write_resolv(domain, nameserver_array);
                 netcfg_activate_static(client);
@@ -505,6 +706,7 @@ int netcfg_get_static(struct debconfclient *client)
             break;
 
         case QUIT:
+            netcfg_discover_stop(listener);
             netcfg_write_common(ipaddress, hostname, domain);
             netcfg_write_static(domain, nameserver_array);
             return 0;
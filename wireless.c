@@ -28,6 +28,87 @@ int is_wireless_iface (const char* iface)
     return (iw_get_basic_config (wfd, (char*)iface, &wc) == 0);
 }
 
+/*
+ * Let every wireless interface in ifaces associate with any access point
+ * at once, and return the index of the first one that does, or -1.  Cards
+ * that stay unassociated are remembered in *defwireless (the last one
+ * wins).  Association is picked up from netlink as soon as it happens;
+ * each card is checked once more when the wait runs out.
+ */
+int netcfg_wireless_find_associated (char **ifaces, int num_ifaces, char **defwireless)
+{
+    wireless_config wc;
+    char **wifs;
+    int *map;
+    int i, n = 0, fd, ret = -1;
+
+    wifs = malloc(num_ifaces * sizeof(*wifs));
+    map = malloc(num_ifaces * sizeof(*map));
+    if (!wifs || !map)
+        goto out;
+
+    /* Subscribe before kicking off association so no event is missed */
+    fd = netlink_link_monitor();
+
+    for (i = 0; i < num_ifaces; i++) {
+        if (iw_get_basic_config(wfd, ifaces[i], &wc) != 0) {
+            di_info("%s is not a wireless interface. Continuing.", ifaces[i]);
+            continue;
+        }
+        wc.essid[0] = '\0';
+        wc.essid_on = 0;
+        iw_set_basic_config(wfd, ifaces[i], &wc);
+
+        map[n] = i;
+        wifs[n++] = ifaces[i];
+    }
+
+    if (n > 0) {
+        int first = -2;
+        int wait = n < NETCFG_WIRELESS_ASSOC_WAIT ? n : NETCFG_WIRELESS_ASSOC_WAIT;
+
+        if (fd >= 0)
+            first = netlink_wait_assoc(fd, wifs, n, wait * 1000);
+        if (first == -2)
+            sleep(1); /* no events; give them the old second */
+
+        /* The card netlink told us about gets looked at first */
+        if (first > 0) {
+            char *tmp = wifs[0];
+            int idx = map[0];
+
+            wifs[0] = wifs[first];
+            map[0] = map[first];
+            wifs[first] = tmp;
+            map[first] = idx;
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+
+    /* Confirm with the driver, in case an event was lost or the card
+     * associated without telling netlink. */
+    for (i = 0; i < n; i++) {
+        iw_get_basic_config(wfd, wifs[i], &wc);
+
+        if (!empty_str(wc.essid)) {
+            di_info("%s is associated with %s. Selecting as default", wifs[i], wc.essid);
+            ret = map[i];
+            break;
+        }
+
+        di_info("%s is not associated. Relegating to defwireless", wifs[i]);
+        free(*defwireless);
+        *defwireless = strdup(wifs[i]);
+    }
+
+ out:
+    free(wifs);
+    free(map);
+    return ret;
+}
+
 int netcfg_wireless_set_essid (struct debconfclient * client, char *iface, char* priority)
 {
     int ret, couldnt_associate = 0;
@@ -257,6 +338,14 @@ int is_wireless_iface (const char *iface)
     return 0;
 }
 
+int netcfg_wireless_find_associated (char **ifaces, int num_ifaces, char **defwireless)
+{
+    (void) ifaces;
+    (void) num_ifaces;
+    (void) defwireless;
+    return -1;
+}
+
 int netcfg_wireless_set_essid (struct debconfclient *client, char *iface, char *priority)
 {
     (void) client;